@@ -0,0 +1,246 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * client list traversal benchmark: walks N clients the way the tiling
+ * and bar code do, once with the old inline Client layout and once
+ * with the hot Client / cold ClientInfo split.
+ *
+ * usage: bench [nclients [passes]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#define WinTitleSize       256
+#define ClassNameSize      32
+#define ISVISIBLE(C)       ((C)->tags & (C)->mon->tagset[(C)->mon->seltags])
+
+typedef struct Monitor Monitor;
+typedef struct OldClient OldClient;
+typedef struct Client Client;
+typedef struct ClientInfo ClientInfo;
+
+struct Monitor {
+	unsigned int seltags;
+	unsigned int tagset[2];
+};
+
+/* the layout before the split */
+struct OldClient {
+	char title[WinTitleSize], class[ClassNameSize], instance[ClassNameSize];
+	float mina, maxa;
+	int x, y, w, h;
+	int oldx, oldy, oldw, oldh;
+	int basew, baseh, incw, inch, maxw, maxh, minw, minh, hintsvalid;
+	int bw, oldbw;
+	int cfgx, cfgy, cfgw, cfgh, cfgbw;
+	int depth, origdepth;
+	unsigned int tags, pid, xkblayout;
+	unsigned long titlegen;
+	int isfixed, isfloating, isurgent, neverfocus, oldfloating, isfullscreen;
+	int compfullscreen, isterminal, noswallow, nojitter, origcompfullscreen;
+	int desktop, geomvalid, noautofocus, isfocused;
+	int isattached;
+	int tiledidx;
+	int protocols;
+	int haswmhints;
+	int grabstate;
+	XWMHints wmhints;
+	OldClient *next, *prev;
+	OldClient *snext, *sprev;
+	OldClient *swallow;
+	Monitor *mon;
+	Window win, origwin, buttonwin;
+	int ismapped;
+};
+
+/* the layout in dwm.c */
+struct Client {
+	Client *next, *prev;
+	Client *snext, *sprev;
+	Monitor *mon;
+	unsigned int tags;
+	int isfloating, isfullscreen, isurgent, isfocused;
+	int x, y, w, h;
+	int bw, oldbw;
+	int cfgx, cfgy, cfgw, cfgh, cfgbw;
+	int geomvalid;
+	int depth;
+	int isfixed, neverfocus, compfullscreen, nojitter, noautofocus;
+	int isattached;
+	int tiledidx;
+	int grabstate;
+	Window win, buttonwin;
+	Client *swallow;
+	ClientInfo *info;
+	int ismapped;
+};
+
+struct ClientInfo {
+	char title[WinTitleSize], class[ClassNameSize], instance[ClassNameSize];
+	unsigned long titlegen;
+	float mina, maxa;
+	int basew, baseh, incw, inch, maxw, maxh, minw, minh, hintsvalid;
+	int oldx, oldy, oldw, oldh, oldfloating;
+	unsigned int pid, xkblayout;
+	int desktop;
+	int protocols;
+	int haswmhints;
+	XWMHints wmhints;
+	int isterminal, noswallow;
+	Window origwin;
+	int origcompfullscreen, origdepth;
+};
+
+static Monitor mon = { 0, { 1 | 4, 2 } };
+
+static void *
+ecalloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (!(p = calloc(nmemb, size))) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* link the clients in a random order, as they end up after focus and
+ * attach changes */
+static void
+shuffle(void **v, int n)
+{
+	void *t;
+	int i, j;
+
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		t = v[i];
+		v[i] = v[j];
+		v[j] = t;
+	}
+}
+
+static OldClient *
+makeold(int n)
+{
+	OldClient **v = ecalloc(n, sizeof(OldClient *));
+	OldClient *head = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v[i] = ecalloc(1, sizeof(OldClient));
+		v[i]->mon = &mon;
+		v[i]->tags = 1 << (i % 9);
+		v[i]->isfloating = i % 5 == 0;
+	}
+	shuffle((void **)v, n);
+	for (i = n - 1; i >= 0; i--) {
+		v[i]->next = head;
+		head = v[i];
+	}
+	free(v);
+	return head;
+}
+
+static Client *
+makenew(int n)
+{
+	Client **v = ecalloc(n, sizeof(Client *));
+	Client *head = NULL;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		/* as createclient() */
+		v[i] = ecalloc(1, sizeof(Client));
+		v[i]->info = ecalloc(1, sizeof(ClientInfo));
+		v[i]->mon = &mon;
+		v[i]->tags = 1 << (i % 9);
+		v[i]->isfloating = i % 5 == 0;
+	}
+	shuffle((void **)v, n);
+	for (i = n - 1; i >= 0; i--) {
+		v[i]->next = head;
+		head = v[i];
+	}
+	free(v);
+	return head;
+}
+
+/* count tiled clients, as arrange() and the layouts do */
+static double
+walkold(OldClient *head, int n, int passes)
+{
+	OldClient *c;
+	volatile int sink;
+	double t;
+	int p, k = 0;
+
+	t = now();
+	for (p = 0; p < passes; p++)
+		for (c = head; c; c = c->next)
+			if (ISVISIBLE(c) && !c->isfloating)
+				k++;
+	t = now() - t;
+	sink = k;
+	(void)sink;
+	return t / ((double)n * passes);
+}
+
+static double
+walknew(Client *head, int n, int passes)
+{
+	Client *c;
+	volatile int sink;
+	double t;
+	int p, k = 0;
+
+	t = now();
+	for (p = 0; p < passes; p++)
+		for (c = head; c; c = c->next)
+			if (ISVISIBLE(c) && !c->isfloating)
+				k++;
+	t = now() - t;
+	sink = k;
+	(void)sink;
+	return t / ((double)n * passes);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 64;
+	int passes = argc > 2 ? atoi(argv[2]) : 0;
+	OldClient *o;
+	Client *c;
+
+	if (n < 1)
+		n = 1;
+	if (passes < 1)
+		passes = 50000000 / n + 1;
+	srand(1);
+	o = makeold(n);
+	c = makenew(n);
+
+	/* warm up */
+	walkold(o, n, 1 + passes / 10);
+	walknew(c, n, 1 + passes / 10);
+
+	printf("sizeof: old Client %zu, Client %zu + ClientInfo %zu\n",
+		sizeof(OldClient), sizeof(Client), sizeof(ClientInfo));
+	printf("%d clients, %d passes\n", n, passes);
+	printf("old layout: %.2f ns/client\n", walkold(o, n, passes));
+	printf("new layout: %.2f ns/client\n", walknew(c, n, passes));
+	return 0;
+}
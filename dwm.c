@@ -10,10 +10,16 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include <fribidi.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
@@ -146,6 +152,69 @@ enum {
 	UTF8ZWNBS = 0xFEFF,   /* zero-width non-breaking space */
 };
 
+/* monitor dirty flags; the deferred work is done by flushmons() */
+enum {
+	DirtyLayout  = 1 << 0,  /* arrangemon() */
+	DirtyStack   = 1 << 1,  /* restackmon() */
+	DirtyBar     = 1 << 2,  /* drawbarmon() */
+	DirtyEWMH    = 1 << 3,  /* _NET_WM_DESKTOP and _NET_CURRENT_DESKTOP */
+};
+
+/* bar segments, from left to right; each one is redrawn only when damaged */
+enum {
+	SegTags      = 1 << 0,
+	SegLtSymbol  = 1 << 1,
+	SegTitle     = 1 << 2,
+	SegStatus    = 1 << 3,
+	SegAll       = SegTags|SegLtSymbol|SegTitle|SegStatus,
+};
+
+/* window roles in the window to client map */
+enum {
+	WinNone = 0,     /* free slot */
+	WinClient,       /* c->win */
+	WinOrig,         /* c->info->origwin of a swallowing client */
+	WinButton,       /* c->buttonwin */
+	WinSystrayIcon,  /* win of a systray icon */
+};
+
+/* scan() passes, in the order windows are managed in */
+enum {
+	ScanNone,
+	ScanRegular,
+	ScanSwallowed,
+	ScanSwallower,
+	ScanTransient,
+};
+
+/* properties fetched by getwinprops() */
+enum {
+	PropClass,
+	PropNetWMName,
+	PropWMName,
+	PropTransientFor,
+	PropNormalHints,
+	PropNetWMState,
+	PropNetWMWindowType,
+	PropWMHints,
+	PropNetWMDesktop,
+	PropWMProtocols,
+	PropLast,
+};
+
+/* WM_PROTOCOLS a client supports, cached in c->info->protocols */
+enum {
+	ProtoDelete     = 1 << 0,
+	ProtoTakeFocus  = 1 << 1,
+};
+
+/* button grabs installed on a client window, cached in c->grabstate */
+enum {
+	GrabNone,
+	GrabUnfocused,
+	GrabFocused,
+};
+
 /* systray and Xembed constants */
 #define _NET_SYSTEM_TRAY_ORIENTATION_HORZ  0
 #define _NET_SYSTEM_TRAY_ORIENTATION_VERT  1
@@ -161,13 +230,25 @@ enum {
 #define OPAQUE       0xFFFFFFFF
 
 /* buffer sizes */
-#define UTF8CacheSize      2048
+#define GlyphDirectSize    0x800 /* latin, greek, cyrillic, hebrew, arabic */
+#define GlyphCacheSize     2048  /* must be a power of two */
+#define NoMatchSetSize     256   /* must be a power of two */
+#define FallbackFontMax    16
+#define FontQueueSize      16
 #define StatusSize         1024
 #define WinTitleSize       256
+#define ClassPropSize      64    /* WM_CLASS length in 32-bit units */
+#define ProtocolsPropSize  32    /* WM_PROTOCOLS length in atoms */
 #define LtSymbolSize       16
 #define ClassNameSize      32
 #define PertagStackSize    16
 #define BackTraceSize      16
+#define TimerListSize      16
+#define WatchListSize      8
+#define WinMapInitSize     64
+#define DispatchSize       512   /* must be a power of two */
+#define BorderCacheSize    32
+#define BorderGCSize       8
 
 /* ==================
  * = Utility Macros
@@ -187,13 +268,15 @@ enum {
 #define WIDTH(C)              ((C)->w + 2 * (C)->bw)
 #define HEIGHT(C)             ((C)->h + 2 * (C)->bw)
 #define GEOM(C)               (C)->x, (C)->y, (C)->w, (C)->h
+#define TSBEFORE(A, B)        ((A).tv_sec < (B).tv_sec \
+                              || ((A).tv_sec == (B).tv_sec && (A).tv_nsec < (B).tv_nsec))
 
 /* draw text with padding */
 #define RENDERTEXTWP(SCM, STR, X, W, INV) \
 	(rendertext(SCM, STR, X, 0, W, barheight, fontheight / 2, INV))
 
-#define ISUTILWIN(W) \
-	(W == root || W == selmon->barwin || (systray && W == systray->win))
+/* width of text drawn with padding */
+#define TEXTWP(STR)           (rendergettextwidth(STR) + (fontheight / 2) * 2)
 
 #define CLEANMASK(MASK) \
 	(MASK & ~(numlockmask|LockMask) \
@@ -218,10 +301,24 @@ struct Pertag {
 	const Layout *lt[2];
 };
 
+struct ButtonGrab {
+	unsigned int button, mod;
+};
+
 struct BarState {
-	int isselmon, isstatusmon, isfloating, bdw;
-	unsigned int tags, occtags, urgtags, nclients, selpos;
-	char statustext[StatusSize], title[WinTitleSize], ltsymbol[LtSymbolSize];
+	int isvalid, bdw;
+	/* tags */
+	unsigned int tags, occgen, urggen;
+	int ismonocle;
+	Client *sel;
+	/* layout symbol */
+	unsigned int ltgen;
+	/* title */
+	int isselmon, isfloating, isfixed;
+	unsigned long titlegen;
+	/* status */
+	int isstatusmon;
+	unsigned long statusgen;
 };
 
 struct ButtonPos {
@@ -248,11 +345,24 @@ struct Monitor {
 	int gappx;
 	unsigned int seltags, sellt, tagset[2];
 	int showbar, topbar;
-	Client *clients;
+	unsigned int dirty;
+	unsigned int occgen;  /* bumped when clients or their tags change */
+	unsigned int urggen;  /* bumped when a client's urgency changes */
+	unsigned int ntagclients[LENGTH(tags)]; /* clients per tag */
+	unsigned int ntagurgent[LENGTH(tags)];  /* urgent clients per tag */
+	unsigned int ltgen;   /* bumped when ltsymbol changes */
+	Client *clients, *clientstail;
 	Client *sel;
-	Client *stack;
+	Client *stack, *stacktail;
 	Monitor *next;
 	Window barwin;
+	Pixmap barpixmap;     /* retained contents of barwin */
+	int barpixmapw;
+	Window *stackorder;   /* last stacking order sent, top to bottom */
+	unsigned int nstackorder;
+	Client **tiled;       /* visible tiled clients in list order, see updatetiled() */
+	unsigned int ntiled, tiledsize, tiledtags;
+	int tiledvalid;
 	const Layout *lt[2];
 	Pertag pertag[LENGTH(tags)];
 	unsigned int pertagstack[PertagStackSize];
@@ -261,25 +371,46 @@ struct Monitor {
 	ButtonPos bp;
 };
 
+/* the list walks of the event loop only read this part of a client, so
+ * it's kept small. anything else goes into its ClientInfo. */
 struct Client {
-	char title[WinTitleSize], class[ClassNameSize], instance[ClassNameSize];
-	float mina, maxa;
+	Client *next, *prev;
+	Client *snext, *sprev;
+	Monitor *mon;
+	unsigned int tags;
+	int isfloating, isfullscreen, isurgent, isfocused;
 	int x, y, w, h;
-	int oldx, oldy, oldw, oldh;
-	int basew, baseh, incw, inch, maxw, maxh, minw, minh, hintsvalid;
 	int bw, oldbw;
-	unsigned int tags, pid, xkblayout;
-	int isfixed, isfloating, isurgent, neverfocus, oldfloating, isfullscreen;
-	int compfullscreen, isterminal, noswallow, nojitter, origcompfullscreen;
-	int desktop, geomvalid, noautofocus, isfocused;
-	Client *next;
-	Client *snext;
+	int cfgx, cfgy, cfgw, cfgh, cfgbw; /* last sent to the server, if geomvalid */
+	int geomvalid;
+	int depth;
+	int isfixed, neverfocus, compfullscreen, nojitter, noautofocus;
+	int isattached; /* counted in mon->ntagclients */
+	int tiledidx;   /* index in mon->tiled, -1 if not tiled */
+	int grabstate;  /* Grab* */
+	Window win, buttonwin;
 	Client *swallow;
-	Monitor *mon;
-	Window win, origwin, buttonwin;
+	ClientInfo *info;
 	int ismapped; /* mapped state for systray icons */
 };
 
+/* the cold part of a client: strings, size hints and swallow bookkeeping */
+struct ClientInfo {
+	char title[WinTitleSize], class[ClassNameSize], instance[ClassNameSize];
+	unsigned long titlegen;
+	float mina, maxa;
+	int basew, baseh, incw, inch, maxw, maxh, minw, minh, hintsvalid;
+	int oldx, oldy, oldw, oldh, oldfloating;
+	unsigned int pid, xkblayout;
+	int desktop;
+	int protocols;  /* Proto* flags */
+	int haswmhints;
+	XWMHints wmhints; /* last known WM_HINTS, if haswmhints */
+	int isterminal, noswallow;
+	Window origwin;
+	int origcompfullscreen, origdepth;
+};
+
 struct Systray {
 	Window win;
 	Client *icons;
@@ -292,20 +423,96 @@ struct ClickEv {
 	int isvalid;
 };
 
+struct WinMap {
+	struct WinMapEntry {
+		Window win;
+		Client *c;
+		int role;
+	} *list;
+	unsigned int size, len; /* size is a power of two */
+};
+
+/* bindings by (keycode or button, clean modifier mask), duplicates are
+ * found in the order they were added */
+struct Dispatch {
+	struct DispatchEntry {
+		unsigned int code, mod;
+		int index; /* into keys[], buttons[] or statusclick[], -1 if empty */
+	} list[DispatchSize];
+};
+
+/* a drawn border pixmap, reused by all windows of the same size, border
+ * width, depth and scheme */
+struct BorderPixmap {
+	int w, h, bw, depth, scm;
+	Pixmap pixmap; /* None if unused */
+	unsigned long lastused;
+};
+
+struct BorderGC {
+	int depth;
+	GC gc;
+};
+
+/* the properties of a window that manage() needs, fetched in one go */
+struct WinProps {
+	xcb_get_property_reply_t *replies[PropLast]; /* NULL if unset */
+	unsigned int pid;
+};
+
+struct Timer {
+	struct timespec when; /* CLOCK_MONOTONIC expiry time */
+	void (*func)(const Arg *arg); /* NULL if the slot is free */
+	Arg arg;
+};
+
+struct Watch {
+	int fd;
+	void (*func)(int fd); /* NULL if the slot is free */
+};
+
 struct XFont {
 	int height, block;
 	XftFont *xftfont;
 	FcPattern *pattern;
+	FcChar8 *file; /* owned by xftfont->pattern, may be NULL */
+	int index;
+	int isfallback;
+	unsigned long lastused;
 	XFont *next;
 };
 
-struct UTF8Cache {
+/* a codepoint range that doesn't cross any blockdefs boundary,
+ * along with the fonts whose block covers it, in font order. */
+struct FontRange {
+	unsigned long start, end;
+	XFont *fonts[LENGTH(fontdefs)]; /* NULL terminated, unless full */
+};
+
+/* a fallback font lookup, done by fontworker() */
+struct FontMatch {
+	unsigned long codepoint;
+	FcPattern *pattern, *match;
+};
+
+struct CharInfo {
+	XFont *font; /* NULL if not cached */
+	int width;
+};
+
+/* codepoints below GlyphDirectSize are looked up directly,
+ * the rest go through a hashed LRU list. */
+struct GlyphCache {
+	CharInfo direct[GlyphDirectSize];
 	struct {
 		unsigned long codepoint;
-		XFont *font;
-		int width;
-	} list[UTF8CacheSize];
-	int idx, len;
+		CharInfo glyph;
+		int hnext;      /* next entry in the hash bucket */
+		int prev, next; /* LRU list, most recently used first */
+	} list[GlyphCacheSize + 1]; /* index 0 is the null entry */
+	int buckets[GlyphCacheSize];
+	int head, tail, len;
+	unsigned long hits, misses; /* for profiling */
 };
 
 struct UnicodeBlockDef {
@@ -424,6 +631,7 @@ static const UnicodeBlockDef blockdefs[] = {
  * =================== */
 
 static char statustext[StatusSize];
+static unsigned long statusgen, titlegen; /* bumped on every update */
 static const char broken[] = "broken";
 
 static Display *dpy;
@@ -433,21 +641,46 @@ static int sw, sh; /* screen width, height */
 static int depth;
 static Visual *visual;
 static Colormap colormap;
-static Pixmap pixmap;
+static Pixmap pixmap; /* render target, see rendersettarget() */
 static GC gc;
 static XFont *fonts;
 static XftDraw *xftdraw;
-static UTF8Cache utf8cache = { .len = 0, .idx = 0 };
-
-static Window root, wmcheckwin, ignoreenterwin = 0;
+static GlyphCache glyphcache;
+static FontRange *fontranges;
+static int nfontranges;
+static unsigned long nomatchset[NoMatchSetSize]; /* codepoints with no fallback font */
+static int nnomatch, nfallbackfonts;
+static unsigned long fontpending[FontQueueSize]; /* codepoints being matched */
+static int nfontpending, fontdropped;
+static int fontpipe[2] = { -1, -1 }; /* font thread -> event loop */
+static pthread_t fontthread;
+static pthread_mutex_t fontmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fontcond = PTHREAD_COND_INITIALIZER;
+static FontMatch *fontqueue[FontQueueSize]; /* guarded by fontmutex */
+static int fontqueuelen = 0, fontquit = 0;  /* guarded by fontmutex */
+static WinMap winmap = { .list = NULL, .size = 0, .len = 0 };
+static Dispatch keydispatch, buttondispatch, statusdispatch;
+static BorderPixmap borderpixmaps[BorderCacheSize];
+static BorderGC bordergcs[BorderGCSize];
+static unsigned long borderclock = 0;
+
+static Window root, wmcheckwin, ignoreenterwin = 0, ignoreenterpending = 0;
 static Monitor *mons, *selmon, **statusmonptr;
 static Systray *systray = NULL;
 static XftColor schemes[SchemeLast][ColorLast];
 static int barheight, fontheight;
 static unsigned int numlockmask = 0;
+static ButtonGrab buttongrabs[LENGTH(buttons) * 4];
+static unsigned int nbuttongrabs = 0;
+static int xkbevbase = -1;
+static unsigned int xkbgroup = 0; /* tracked through XkbStateNotify */
 static volatile int running = 1, mustrestart = 0;
 static int startup = 0;
 static int currentdesktop = -1;
+static int sigfd = -1, timerfd = -1;
+static sigset_t sigmask;
+static Timer timers[TimerListSize];
+static Watch watches[WatchListSize];
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 
 /* event handlers */
@@ -477,6 +710,10 @@ static void (*handler[LASTEvent]) (XEvent *) = {
 /* compile-time check if all tags fit into an unsigned int bit array. */
 struct NumTags { char limitexceeded[LENGTH(tags) > 31 ? -1 : 1]; };
 
+/* compile-time check if the dispatch tables stay at most half full. */
+struct NumBindings { char limitexceeded[
+	MAX(LENGTH(keys), MAX(LENGTH(buttons), LENGTH(statusclick))) * 2 > DispatchSize ? -1 : 1]; };
+
 int
 main(int argc, char *argv[])
 {
@@ -524,20 +761,30 @@ void
 setup(void)
 {
 	XSetWindowAttributes swa;
+	XkbStateRec xkbstate;
 	char trayatom_name[32];
 
-	/* clean up any zombies immediately */
-	sigchld(0);
-
 #ifdef BACKTRACE
 	/* signal handler for printing a backtrace on segfault */
 	if (signal(SIGSEGV, sigbacktrace) == SIG_ERR)
 		die("can't install SIGSEGV handler:");
 #endif /* BACKTRACE */
 
-	/* signal handler for restarting */
-	if (signal(SIGHUP, sigrestart) == SIG_ERR)
-		die("can't install SIGHUP handler:");
+	/* receive SIGCHLD and SIGHUP (restart) through the event loop */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	sigaddset(&sigmask, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &sigmask, NULL) == -1)
+		die("sigprocmask:");
+	if ((sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+		die("signalfd:");
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+		die("timerfd_create:");
+	addwatch(sigfd, readsignals);
+	addwatch(timerfd, readtimers);
+
+	/* clean up any zombies immediately */
+	reapchildren();
 
 	/* init vars */
 	screen = DefaultScreen(dpy);
@@ -583,8 +830,20 @@ setup(void)
 	XChangeWindowAttributes(dpy, root, CWEventMask|CWCursor, &swa);
 	XSelectInput(dpy, root, swa.event_mask);
 
+	updatenumlockmask();
+	updatebuttongrabs();
 	grabkeys();
 
+	/* follow the keyboard group instead of querying it on every focus */
+	if (XkbQueryExtension(dpy, NULL, &xkbevbase, NULL, NULL, NULL)) {
+		XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbStateNotify,
+			XkbGroupStateMask, XkbGroupStateMask);
+		if (XkbGetState(dpy, XkbUseCoreKbd, &xkbstate) == Success)
+			xkbgroup = xkbstate.group;
+	} else {
+		xkbevbase = -1;
+	}
+
 #ifdef __OpenBSD__
 	if (pledge("stdio rpath proc exec ps", NULL) == -1)
 		die("pledge");
@@ -594,66 +853,351 @@ setup(void)
 void
 scan(void)
 {
-	int i;
+	int i, pass, viewable, istrans;
 	unsigned int num;
+	uint32_t swallow, state, transfor;
 	Window d1, d2, *wins = NULL;
-	XWindowAttributes wa;
+	XWindowAttributes *wa;
+	xcb_get_window_attributes_cookie_t *attrcookies;
+	xcb_get_geometry_cookie_t *geomcookies;
+	xcb_get_property_cookie_t *propcookies;
+	xcb_get_window_attributes_reply_t *attr;
+	xcb_get_geometry_reply_t *geom;
+	xcb_get_property_reply_t *r[3];
+	int *order;
+	unsigned int *pids;
+#ifdef __linux__
+	xcb_res_query_client_ids_cookie_t pidcookie;
+#endif /* __linux__ */
 
 	if (!XQueryTree(dpy, root, &d1, &d2, &wins, &num))
 		return;
 
-	/* regular windows */
+	wa = ecalloc(num, sizeof(XWindowAttributes));
+	order = ecalloc(num, sizeof(int));
+	pids = ecalloc(num, sizeof(unsigned int));
+	attrcookies = ecalloc(num, sizeof(xcb_get_window_attributes_cookie_t));
+	geomcookies = ecalloc(num, sizeof(xcb_get_geometry_cookie_t));
+	propcookies = ecalloc(num * 3, sizeof(xcb_get_property_cookie_t));
+
+	/* ask for everything about every window first... */
 	for (i = 0; i < num; i++) {
-		if (!XGetWindowAttributes(dpy, wins[i], &wa)
-		|| wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1)
-		|| getatomprop(wins[i], atoms[DWMSwallow]) != None)
-			continue;
-		if (wa.map_state == IsViewable || getstate(wins[i]) == IconicState)
-			manage(wins[i], wa);
+		attrcookies[i] = xcb_get_window_attributes(xcon, wins[i]);
+		geomcookies[i] = xcb_get_geometry(xcon, wins[i]);
+		propcookies[i * 3] = requestprop(wins[i], XA_WM_TRANSIENT_FOR, XA_WINDOW, 1);
+		propcookies[i * 3 + 1] = requestprop(wins[i], atoms[WMState], atoms[WMState], 2);
+		propcookies[i * 3 + 2] = requestprop(wins[i], atoms[DWMSwallow], XA_ATOM, 1);
 	}
+#ifdef __linux__
+	pidcookie = requestwinpids(wins, num);
+#endif /* __linux__ */
 
-	/* swallowed windows */
+	/* ...then sort them into the order they are managed in */
 	for (i = 0; i < num; i++) {
-		if (!XGetWindowAttributes(dpy, wins[i], &wa)
-		|| wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1))
-			continue;
-		if (getatomprop(wins[i], atoms[DWMSwallow]) == atoms[DWMSwallowed])
-			manage(wins[i], wa);
-	}
+		attr = xcb_get_window_attributes_reply(xcon, attrcookies[i], NULL);
+		geom = xcb_get_geometry_reply(xcon, geomcookies[i], NULL);
+		r[0] = replyprop(propcookies[i * 3]);
+		r[1] = replyprop(propcookies[i * 3 + 1]);
+		r[2] = replyprop(propcookies[i * 3 + 2]);
+
+		order[i] = ScanNone;
+		if (attr && geom) {
+			setwinattrs(&wa[i], attr, geom);
+			istrans = getpropvalue(r[0], &transfor);
+			if (!getpropvalue(r[1], &state))
+				state = -1;
+			if (!getpropvalue(r[2], &swallow))
+				swallow = None;
+			viewable = wa[i].map_state == IsViewable || state == IconicState;
+
+			if (wa[i].override_redirect || istrans)
+				order[i] = istrans && viewable ? ScanTransient : ScanNone;
+			else if (swallow == None)
+				order[i] = viewable ? ScanRegular : ScanNone;
+			else if (swallow == atoms[DWMSwallowed])
+				order[i] = ScanSwallowed;
+			else if (swallow == atoms[DWMSwallower])
+				order[i] = ScanSwallower;
+		}
 
-	/* swallower windows */
-	for (i = 0; i < num; i++) { /* now swallower windows */
-		if (!XGetWindowAttributes(dpy, wins[i], &wa)
-		|| wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1))
-			continue;
-		if (getatomprop(wins[i], atoms[DWMSwallow]) == atoms[DWMSwallower])
-			manage(wins[i], wa);
+		free(attr);
+		free(geom);
+		free(r[0]);
+		free(r[1]);
+		free(r[2]);
 	}
 
-	/* transient windows */
-	for (i = 0; i < num; i++) {
-		if (!XGetWindowAttributes(dpy, wins[i], &wa))
-			continue;
-		if (XGetTransientForHint(dpy, wins[i], &d1)
-		&& (wa.map_state == IsViewable || getstate(wins[i]) == IconicState))
-			manage(wins[i], wa);
-	}
+#ifdef __linux__
+	replywinpids(pidcookie, wins, pids, num);
+#else
+	for (i = 0; i < num; i++)
+		pids[i] = getwinpid(wins[i]);
+#endif /* __linux__ */
 
-	XFree(wins);
+	/* regular, swallowed, swallower, then transient windows */
+	for (pass = ScanRegular; pass <= ScanTransient; pass++)
+		for (i = 0; i < num; i++)
+			if (order[i] == pass)
+				manage(wins[i], wa[i], pids[i]);
 
 	focus(NULL);
 	arrange(NULL);
+
+	free(attrcookies);
+	free(geomcookies);
+	free(propcookies);
+	free(order);
+	free(pids);
+	free(wa);
+	XFree(wins);
+}
+
+/* fill in wa from the GetWindowAttributes and GetGeometry replies.
+ * the visual is left NULL, nothing that is given these attributes uses it. */
+void
+setwinattrs(XWindowAttributes *wa, xcb_get_window_attributes_reply_t *attr,
+	xcb_get_geometry_reply_t *geom)
+{
+	wa->x = geom->x;
+	wa->y = geom->y;
+	wa->width = geom->width;
+	wa->height = geom->height;
+	wa->border_width = geom->border_width;
+	wa->depth = geom->depth;
+	wa->visual = NULL;
+	wa->root = geom->root;
+	wa->class = attr->_class;
+	wa->bit_gravity = attr->bit_gravity;
+	wa->win_gravity = attr->win_gravity;
+	wa->backing_store = attr->backing_store;
+	wa->backing_planes = attr->backing_planes;
+	wa->backing_pixel = attr->backing_pixel;
+	wa->save_under = attr->save_under;
+	wa->colormap = attr->colormap;
+	wa->map_installed = attr->map_is_installed;
+	wa->map_state = attr->map_state;
+	wa->all_event_masks = attr->all_event_masks;
+	wa->your_event_mask = attr->your_event_mask;
+	wa->do_not_propagate_mask = attr->do_not_propagate_mask;
+	wa->override_redirect = attr->override_redirect;
+	wa->screen = ScreenOfDisplay(dpy, screen);
 }
 
 void
 run(void)
 {
 	XEvent ev;
+	struct pollfd pfds[1 + WatchListSize];
+	int i, j, n;
 
 	XSync(dpy, 0);
-	while (running && !XNextEvent(dpy, &ev)) {
-		if (handler[ev.type])
-			handler[ev.type](&ev); /* call handler */
+	while (running) {
+		if (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			if (ev.type == xkbevbase)
+				xkbevent(&ev);
+			else if (handler[ev.type])
+				handler[ev.type](&ev); /* call handler */
+			continue;
+		}
+
+		/* do the deferred work once the queued events are drained */
+		flushmons();
+		if (XPending(dpy))
+			continue;
+
+		pfds[0].fd = ConnectionNumber(dpy);
+		pfds[0].events = POLLIN;
+		for (n = 1, i = 0; i < LENGTH(watches); i++) {
+			if (watches[i].func) {
+				pfds[n].fd = watches[i].fd;
+				pfds[n++].events = POLLIN;
+			}
+		}
+
+		if (poll(pfds, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			die("poll:");
+		}
+
+		/* the watch list may change in the callbacks, so look up each fd */
+		for (i = 1; i < n; i++) {
+			if (!pfds[i].revents)
+				continue;
+			for (j = 0; j < LENGTH(watches); j++) {
+				if (watches[j].func && watches[j].fd == pfds[i].fd) {
+					watches[j].func(pfds[i].fd);
+					break;
+				}
+			}
+		}
+	}
+}
+
+/* call func(fd) from the event loop whenever fd becomes readable. */
+int
+addwatch(int fd, void (*func)(int fd))
+{
+	int i;
+
+	for (i = 0; i < LENGTH(watches); i++) {
+		if (!watches[i].func) {
+			watches[i].fd = fd;
+			watches[i].func = func;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+delwatch(int fd)
+{
+	int i;
+
+	for (i = 0; i < LENGTH(watches); i++)
+		if (watches[i].func && watches[i].fd == fd)
+			watches[i].func = NULL;
+}
+
+/* call func(arg) from the event loop after ms milliseconds.
+ * returns the timer's id, or -1 if there's no free slot. */
+int
+addtimer(unsigned int ms, void (*func)(const Arg *arg), const Arg *arg)
+{
+	int i;
+	Timer *t;
+
+	for (i = 0; i < LENGTH(timers) && timers[i].func; i++);
+	if (i == LENGTH(timers))
+		return -1;
+
+	t = &timers[i];
+	clock_gettime(CLOCK_MONOTONIC, &t->when);
+	t->when.tv_sec += ms / 1000;
+	t->when.tv_nsec += (ms % 1000) * 1000000L;
+	if (t->when.tv_nsec >= 1000000000L) {
+		t->when.tv_sec++;
+		t->when.tv_nsec -= 1000000000L;
+	}
+	t->func = func;
+	if (arg)
+		t->arg = *arg;
+	else
+		memset(&t->arg, 0, sizeof(t->arg));
+
+	updatetimerfd();
+	return i;
+}
+
+void
+deltimer(int id)
+{
+	if (id < 0 || id >= LENGTH(timers))
+		return;
+	timers[id].func = NULL;
+	updatetimerfd();
+}
+
+/* arm the timerfd for the earliest pending timer, or disarm it. */
+void
+updatetimerfd(void)
+{
+	struct itimerspec its = {{0}};
+	Timer *t, *next = NULL;
+
+	for (t = timers; t < timers + LENGTH(timers); t++)
+		if (t->func && (!next || TSBEFORE(t->when, next->when)))
+			next = t;
+
+	if (next) {
+		its.it_value = next->when;
+		/* a zero it_value would disarm the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+void
+readtimers(int fd)
+{
+	uint64_t expirations;
+	struct timespec now;
+	Timer *t, expired;
+
+	while (read(fd, &expirations, sizeof(expirations)) > 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (t = timers; t < timers + LENGTH(timers); t++) {
+		if (t->func && !TSBEFORE(now, t->when)) {
+			/* free the slot first, so func can add timers */
+			expired = *t;
+			t->func = NULL;
+			expired.func(&expired.arg);
+		}
+	}
+
+	updatetimerfd();
+}
+
+void
+readsignals(int fd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGCHLD)
+			reapchildren();
+		else if (si.ssi_signo == SIGHUP)
+			restart(NULL);
+	}
+}
+
+void
+reapchildren(void)
+{
+	while (0 < waitpid(-1, NULL, WNOHANG));
+}
+
+/* do the layout, stacking, bar and EWMH work that the event handlers have
+ * marked as dirty, so that a burst of events results in a single pass. */
+void
+flushmons(void)
+{
+	Monitor *m;
+	unsigned int dirty;
+	int ewmh;
+
+	do {
+		for (ewmh = 0, m = mons; m; m = m->next) {
+			if (m->dirty & DirtyLayout)
+				arrangemon(m);
+			if (m->dirty & DirtyStack)
+				restackmon(m);
+			if (m->dirty & DirtyEWMH) {
+				m->dirty &= ~DirtyEWMH;
+				updatemondesktops(m);
+				ewmh = 1;
+			}
+			if (m->dirty & DirtyBar)
+				drawbarmon(m);
+		}
+
+		if (ewmh)
+			updatecurrentdesktop();
+
+		/* restackmon() may have unfullscreened clients */
+		for (dirty = 0, m = mons; m; m = m->next)
+			dirty |= m->dirty;
+	} while (dirty);
+
+	if (ignoreenterpending) {
+		checkignoreenter(ignoreenterpending);
+		ignoreenterpending = 0;
 	}
 }
 
@@ -667,7 +1211,7 @@ maprequest(XEvent *e)
 		return;
 
 	if (!wintoclient(ev->window))
-		manage(ev->window, wa);
+		manage(ev->window, wa, -1);
 }
 
 void
@@ -774,7 +1318,6 @@ configurenotify(XEvent *e)
 	sh = ev->height;
 
 	if (updatemons() || updated) {
-		renderupdatesize();
 		focus(NULL);
 		arrange(NULL);
 	}
@@ -823,10 +1366,10 @@ configurerequest(XEvent *e)
 	if ((c->y + c->h) > m->my + m->mh)
 		c->y = m->my + (m->mh / 2 - HEIGHT(c) / 2); /* center in y direction */
 
+	/* a denied or no-op request still has to be answered (ICCCM 4.1.5) */
 	if (ISVISIBLE(c)) {
-		c->geomvalid = 0;
-		resize(c, GEOM(c), 0);
-		XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+		if (!resize(c, GEOM(c), 0))
+			sendconfigurenotify(c);
 	}
 	else if ((ev->value_mask & (CWX|CWY)) && !(ev->value_mask & (CWWidth|CWHeight)))
 		sendconfigurenotify(c);
@@ -844,7 +1387,8 @@ propertynotify(XEvent *e)
 		updatestatustext();
 		drawbar(STATUSMON);
 	}
-	else if (ev->state == PropertyDelete)
+	else if (ev->state == PropertyDelete
+		&& ev->atom != XA_WM_HINTS && ev->atom != atoms[WMProtocols])
 		return;
 
 	/* return early if property is not supported */
@@ -852,6 +1396,7 @@ propertynotify(XEvent *e)
 	 && ev->atom != netatoms[NetWMWindowType]
 	 && ev->atom != netatoms[NetWMName]
 	 && ev->atom != XA_WM_HINTS
+	 && ev->atom != atoms[WMProtocols]
 	 && ev->atom != XA_WM_NORMAL_HINTS
 	 && ev->atom != XA_WM_TRANSIENT_FOR)
 		return;
@@ -875,12 +1420,15 @@ propertynotify(XEvent *e)
 			drawbar(c->mon);
 	}
 
+	if (ev->atom == atoms[WMProtocols])
+		updateprotocols(c);
+
 	if (ev->atom == XA_WM_HINTS) {
 		updatewmhints(c);
 		drawbar(NULL);
 	}
 	else if (ev->atom == XA_WM_NORMAL_HINTS) {
-		c->hintsvalid = 0;
+		c->info->hintsvalid = 0;
 		arrange(c->mon);
 	}
 	else if (ev->atom == XA_WM_TRANSIENT_FOR
@@ -924,20 +1472,11 @@ clientmessage(XEvent *e)
 void
 keypress(XEvent *e)
 {
-	int i;
-	KeySym keysym;
-	XKeyEvent *ev;
-
-	ev = &e->xkey;
-	keysym = XKeycodeToKeysym(dpy, (KeyCode)ev->keycode, 0);
+	int i, pos = -1;
+	XKeyEvent *ev = &e->xkey;
 
-	for (i = 0; i < LENGTH(keys); i++)
-		if (keysym == keys[i].keysym
-		&& CLEANMASK(keys[i].mod) == CLEANMASK(ev->state)
-		&& keys[i].func)
-		{
-			keys[i].func(&(keys[i].arg));
-		}
+	while ((i = dispatchfind(&keydispatch, ev->keycode, CLEANMASK(ev->state), &pos)) >= 0)
+		keys[i].func(&(keys[i].arg));
 }
 
 void
@@ -947,7 +1486,11 @@ expose(XEvent *e)
 	XExposeEvent *ev = &e->xexpose;
 
 	if (ev->count == 0 && (m = wintomon(ev->window))) {
-		drawbar(m);
+		/* the bar's contents are retained, unless it hasn't been drawn yet */
+		if (m->bs.isvalid)
+			rendermap(m, 0, m->bdw);
+		else
+			drawbar(m);
 		if (m == STATUSMON)
 			systrayupdate();
 	}
@@ -977,34 +1520,84 @@ void
 mappingnotify(XEvent *e)
 {
 	XMappingEvent *ev = &e->xmapping;
+	unsigned int oldmask = numlockmask;
+	Monitor *m;
+	Client *c;
 
 	XRefreshKeyboardMapping(ev);
-	if (ev->request == MappingKeyboard)
+	if (ev->request != MappingKeyboard && ev->request != MappingModifier)
+		return;
+
+	updatenumlockmask();
+	if (numlockmask != oldmask) {
+		updatebuttongrabs();
+		for (m = mons; m; m = m->next)
+			for (c = m->clients; c; c = c->next) {
+				c->grabstate = GrabNone;
+				grabbuttons(c, c->isfocused);
+			}
+	}
+	if (ev->request == MappingKeyboard || numlockmask != oldmask)
 		grabkeys();
 }
 
 void
-manage(Window w, XWindowAttributes wa)
+xkbevent(XEvent *e)
+{
+	XkbEvent *ev = (XkbEvent *)e;
+
+	if (ev->any.xkb_type == XkbStateNotify)
+		xkbgroup = ev->state.group;
+}
+
+Client *
+createclient(void)
+{
+	Client *c = ecalloc(1, sizeof(Client));
+
+	c->info = ecalloc(1, sizeof(ClientInfo));
+	c->tiledidx = -1;
+	return c;
+}
+
+void
+freeclient(Client *c)
+{
+	free(c->info);
+	free(c);
+}
+
+/* pid is the pid of w's client if already known, or -1 */
+void
+manage(Window w, XWindowAttributes wa, int pid)
 {
 	Client *c, *t = NULL;
+	WinProps props;
+	uint32_t transfor;
+	int istrans;
+
+	getwinprops(w, pid, &props);
 
-	c = ecalloc(1, sizeof(Client));
+	c = createclient();
 	c->win = w;
 	c->mon = selmon;
-	c->desktop = -1;
+	c->info->desktop = -1;
 	c->oldbw = wa.border_width;
-	c->xkblayout  = xkblayout;
+	c->info->xkblayout  = xkblayout;
 	c->noautofocus = noautofocus;
-	c->w = c->oldw = wa.width;
-	c->h = c->oldh = wa.height;
-	c->pid = getwinpid(c->win);
+	c->w = c->info->oldw = wa.width;
+	c->h = c->info->oldh = wa.height;
+	c->depth = wa.depth;
+	c->info->pid = props.pid;
 
-	updateclass(c);
-	updatetitle(c);
+	setclass(c, props.replies[PropClass]);
+	settitle(c, props.replies[PropNetWMName], props.replies[PropWMName]);
 	applyrules(c);
 
 	c->bw = MIN(borderpx, MIN(c->mon->ww, c->mon->wh) / 3);
-	if ((c->isfloating = gettransientfor(c->win, &t) || c->isfloating) && t) {
+	if ((istrans = getpropvalue(props.replies[PropTransientFor], &transfor)))
+		t = wintoclient(transfor);
+	if ((c->isfloating = istrans || c->isfloating) && t) {
 		c->mon = t->mon;
 		c->tags = t->tags;
 		c->x = t->x + (t->w - WIDTH(c)) / 2;
@@ -1015,27 +1608,30 @@ manage(Window w, XWindowAttributes wa)
 	}
 
 	if (startup)
-		loadclienttagsandmon(c);
+		loadclienttagsandmon(c, props.replies[PropNetWMDesktop]);
 
 	XSetWindowBorderWidth(dpy, c->win, c->bw);
-	drawborder(c->win, SchemeNorm);
+	drawborder(c, SchemeNorm);
 
 	/* updatewinbutton(c); */
-	updatesizehints(c);
-	updatewindowtype(c);
-	updatewmhints(c);
+	setsizehints(c, props.replies[PropNormalHints]);
+	setwmhints(c, props.replies[PropWMHints]); /* before setfullscreen() may seturgent() */
+	setprotocols(c, props.replies[PropWMProtocols]);
+	setwindowtype(c, props.replies[PropNetWMState], props.replies[PropNetWMWindowType]);
+	freewinprops(&props);
 	appendtoclientlist(c->win);
 	XSelectInput(dpy, c->win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
 	grabbuttons(c, 0);
 
 #ifdef __linux__
-	if (c->pid)
-		setcardprop(c->win, netatoms[NetWMPID], c->pid);
+	if (c->info->pid)
+		setcardprop(c->win, netatoms[NetWMPID], c->info->pid);
 #endif /* __linux__ */
 
 	if (swallow(c))
 		return;
 
+	winmapset(c->win, c, WinClient);
 	setclientstate(c, NormalState);
 	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
 
@@ -1073,14 +1669,27 @@ manage(Window w, XWindowAttributes wa)
 	}
 }
 
+/* the group is updated optimistically; XkbStateNotify confirms it */
+void
+setxkbgroup(unsigned int group)
+{
+	if (group == xkbgroup)
+		return;
+	XkbLockGroup(dpy, XkbUseCoreKbd, group);
+	xkbgroup = group;
+}
+
 void
 unmanage(Client *c, int destroyed)
 {
 	Monitor *m = c->mon;
 
-	XkbLockGroup(dpy, XkbUseCoreKbd, xkblayout);
+	/* its windows may be gone, and their ids reused */
+	m->nstackorder = 0;
 
+	/* otherwise focus(NULL) below locks the group of the next client */
 	if (c->swallow) {
+		setxkbgroup(xkblayout);
 		unswallow(c, destroyed, 0);
 		return;
 	}
@@ -1097,11 +1706,15 @@ unmanage(Client *c, int destroyed)
 		/* XUngrabServer(dpy); */
 	}
 
-	XDestroyWindow(dpy, c->buttonwin);
+	winmapdel(c->win);
+	if (c->buttonwin) {
+		winmapdel(c->buttonwin);
+		XDestroyWindow(dpy, c->buttonwin);
+	}
 	tagreduced(c, 1, 0);
 	detach(c);
 	detachstack(c);
-	free(c);
+	freeclient(c);
 	updateclientlist();
 	arrange(m);
 	focus(NULL);
@@ -1117,6 +1730,7 @@ cleanup(void)
 	selmon->tagset[selmon->seltags] = ~0 & TAGMASK;
 	selmon->lt[selmon->sellt] = &lt;
 	arrange(selmon);
+	flushmons();
 
 	/* unmanage clients */
 	/* XGrabServer(dpy); */
@@ -1129,7 +1743,7 @@ cleanup(void)
 			XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
 			setclientstate(c, WithdrawnState);
 			if (c->swallow) {
-				c->swallow->win = c->origwin;
+				c->swallow->win = c->info->origwin;
 				c->swallow->mon = c->mon;
 				c->swallow->tags = c->tags;
 				updateclientdesktop(c->swallow);
@@ -1146,7 +1760,7 @@ cleanup(void)
 		for (c = m->clients; c;) {
 			f = c;
 			c = c->next;
-			free(f);
+			freeclient(f);
 		}
 	}
 
@@ -1155,6 +1769,7 @@ cleanup(void)
 
 	systraycleanup();
 	renderfree();
+	free(winmap.list);
 
 	XDestroyWindow(dpy, wmcheckwin);
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
@@ -1177,6 +1792,10 @@ cleanupmon(Monitor *mon)
 	}
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	if (mon->barpixmap)
+		XFreePixmap(dpy, mon->barpixmap);
+	free(mon->stackorder);
+	free(mon->tiled);
 	free(mon);
 }
 
@@ -1185,7 +1804,7 @@ swallow(Client *c)
 {
 	Client *t;
 
-	if (c->noswallow || c->isterminal
+	if (c->info->noswallow || c->info->isterminal
 		|| (c->isfloating && !c->isfullscreen && !swallowfloating)
 		|| !(t = getparentterminal(c)))
 	{
@@ -1204,18 +1823,29 @@ swallow(Client *c)
 	c->mon = t->mon;
 	c->tags = t->tags;
 
-	t->origwin = t->win;
+	t->info->origwin = t->win;
 	t->win = c->win;
+	winmapset(t->info->origwin, t, WinOrig);
+	winmapset(t->win, t, WinClient);
 
-	t->origcompfullscreen = t->compfullscreen;
+	t->info->origcompfullscreen = t->compfullscreen;
 	t->compfullscreen = c->compfullscreen;
+	t->info->origdepth = t->depth;
+	t->depth = c->depth;
+
+	/* t now stands for c->win, take over what is cached about it */
+	t->info->protocols = c->info->protocols;
+	t->info->haswmhints = c->info->haswmhints;
+	t->info->wmhints = c->info->wmhints;
+	t->neverfocus = c->neverfocus;
+	t->grabstate = c->grabstate;
 
 	t->geomvalid = 0;
 	t->isfocused = 0;
 
 	updatetitle(t);
 	setatomprop(t->win, atoms[DWMSwallow], atoms[DWMSwallower]);
-	setatomprop(t->origwin, atoms[DWMSwallow], atoms[DWMSwallowed]);
+	setatomprop(t->info->origwin, atoms[DWMSwallow], atoms[DWMSwallowed]);
 	setfullscreenprop(t->win, t->isfullscreen);
 	arrange(t->mon);
 	XMapWindow(dpy, t->win);
@@ -1246,6 +1876,11 @@ unswallow(Client *c, int destroyed, int reattach)
 	if (reattach) {
 		c->swallow->mon = c->mon;
 		c->swallow->tags = c->tags;
+		c->swallow->info->protocols = c->info->protocols;
+		c->swallow->info->haswmhints = c->info->haswmhints;
+		c->swallow->info->wmhints = c->info->wmhints;
+		c->swallow->neverfocus = c->neverfocus;
+		c->swallow->grabstate = c->grabstate;
 		XDeleteProperty(dpy, c->swallow->win, atoms[DWMSwallow]);
 		setclientstate(c->swallow, NormalState);
 		updatetitle(c->swallow);
@@ -1253,17 +1888,22 @@ unswallow(Client *c, int destroyed, int reattach)
 		attachdirection(c->swallow);
 		attachstack(c->swallow);
 		XMapWindow(dpy, c->swallow->win);
+		winmapset(c->swallow->win, c->swallow, WinClient);
 		c->swallow = NULL;
 	} else {
-		free(c->swallow);
+		winmapdel(c->swallow->win);
+		freeclient(c->swallow);
 		c->swallow = NULL;
 		updateclientlist();
 	}
 
-	c->win = c->origwin;
-	c->compfullscreen = c->origcompfullscreen;
+	c->win = c->info->origwin;
+	winmapset(c->win, c, WinClient);
+	c->compfullscreen = c->info->origcompfullscreen;
+	c->depth = c->info->origdepth;
 	c->geomvalid = 0;
 	c->isfocused = 0;
+	c->grabstate = GrabNone; /* ungrabbed in swallow() */
 
 	grabbuttons(c, 0);
 	XSelectInput(dpy, c->win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
@@ -1271,6 +1911,8 @@ unswallow(Client *c, int destroyed, int reattach)
 	setfullscreenprop(c->win, c->isfullscreen);
 	setclientstate(c, NormalState);
 	updatetitle(c);
+	updatewmhints(c);
+	updateprotocols(c);
 	updateclientdesktop(c);
 	XMapWindow(dpy, c->win);
 	focus(NULL);
@@ -1281,13 +1923,22 @@ void
 unmanageswallowed(Client *c)
 {
 	XDeleteProperty(dpy, c->win, atoms[DWMSwallow]);
-	free(c->swallow);
+	winmapdel(c->info->origwin);
+	freeclient(c->swallow);
 	c->swallow = NULL;
 	updateclientlist();
 }
 
+/* ignore the enternotify event of w, if w ends up under the pointer
+ * once the pending layout work is done. */
 void
 ignoreenter(Window w)
+{
+	ignoreenterpending = w;
+}
+
+void
+checkignoreenter(Window w)
 {
 	Window win, wtmp;
 	unsigned int uitmp;
@@ -1376,18 +2027,13 @@ updatemons(void)
 		for (i = xsicount; i < moncount; i++) {
 			updated = 1;
 			for (m = mons; m && m->next; m = m->next);
-			for (c = m->clients; c; c = c->next) {
+			while ((c = m->clients)) {
+				detach(c);
+				detachstack(c);
 				c->mon = mons;
 				attachdirection(c);
 				attachstackbottom(c);
 			}
-			/* while ((c = m->clients)) { */
-			/* 	m->clients = c->next; */
-			/* 	detachstack(c); */
-			/* 	c->mon = mons; */
-			/* 	attachdirection(c); */
-			/* 	attachstackbottom(c); */
-			/* } */
 			if (m == selmon)
 				selmon = mons;
 			cleanupmon(m);
@@ -1491,15 +2137,15 @@ applyrules(Client *c)
 
 	for (i = 0; i < LENGTH(rules); i++) {
 		r = &rules[i];
-		if ((!r->title || strstr(c->title, r->title))
-		 && (!r->class || strstr(c->class, r->class))
-		 && (!r->instance || strstr(c->instance, r->instance)))
+		if ((!r->title || strstr(c->info->title, r->title))
+		 && (!r->class || strstr(c->info->class, r->class))
+		 && (!r->instance || strstr(c->info->instance, r->instance)))
 		{
 			c->isfloating = r->isfloating;
 			c->compfullscreen = r->compfullscreen;
 			c->noautofocus = r->noautofocus;
-			c->noswallow  = r->noswallow;
-			c->isterminal = r->isterminal;
+			c->info->noswallow  = r->noswallow;
+			c->info->isterminal = r->isterminal;
 			c->nojitter   = r->nojitter;
 			c->tags |= r->tags;
 			for (m = mons; m && m->num != r->monitor; m = m->next);
@@ -1515,7 +2161,6 @@ focus(Client *c)
 {
 	Client *f;
 	Monitor *m;
-	XkbStateRec xkbstate;
 
 	if (!c || !ISVISIBLE(c))
 		for (c = selmon->stack; c && !ISVISIBLE(c); c = c->snext);
@@ -1528,19 +2173,20 @@ focus(Client *c)
 			if (f->isfocused) {
 				f->isfocused = 0;
 				grabbuttons(f, 0);
-				drawborder(f->win, SchemeNorm);
-				XkbGetState(dpy, XkbUseCoreKbd, &xkbstate);
-				f->xkblayout = xkbstate.group;
-				XkbLockGroup(dpy, XkbUseCoreKbd, xkblayout);
+				drawborder(f, SchemeNorm);
+				f->info->xkblayout = xkbgroup;
 				break;
 			}
 
+	/* lock the final group only, an intermediate one would race with
+	 * its own StateNotify */
+	setxkbgroup(c ? c->info->xkblayout : xkblayout);
+
 	if (c) {
 		c->isfocused = 1;
 		selmon = c->mon;
 		if (c->isurgent)
 			seturgent(c, 0);
-		XkbLockGroup(dpy, XkbUseCoreKbd, c->xkblayout);
 		grabbuttons(c, 1);
 		detachstack(c);
 		attachstack(c);
@@ -1554,7 +2200,7 @@ focus(Client *c)
 	}
 
 	drawbar(NULL);
-	updatecurrentdesktop();
+	selmon->dirty |= DirtyEWMH;
 }
 
 void
@@ -1574,26 +2220,66 @@ focusinput(Client *c)
 	sendevent(c, atoms[WMTakeFocus]);
 }
 
+/* mark m (or all monitors if m is NULL) for a layout pass in flushmons(). */
 void
 arrange(Monitor *m)
 {
-	Client *c;
-
 	if (!m) {
 		for (m = mons; m; m = m->next)
 			arrange(m);
 		return;
 	}
 
+	m->dirty |= DirtyLayout;
+	m->tiledvalid = 0;
+}
+
+void
+arrangemon(Monitor *m)
+{
+	m->dirty &= ~DirtyLayout;
+
 	showhide(m->stack);
 
-	strscpy(m->ltsymbol, m->lt[m->sellt]->symbol, sizeof(m->ltsymbol));
+	if (strcmp(m->ltsymbol, m->lt[m->sellt]->symbol) != 0) {
+		strscpy(m->ltsymbol, m->lt[m->sellt]->symbol, sizeof(m->ltsymbol));
+		m->ltgen++;
+	}
+	updatetiled(m);
 	if (m->lt[m->sellt]->arrange)
 		m->lt[m->sellt]->arrange(m);
 
-	restack(m);
-	for (c = m->clients; c; c = c->next)
-		updateclientdesktop(c);
+	m->dirty |= DirtyStack|DirtyEWMH;
+}
+
+/* rebuild the vector of visible tiled clients, unless it's still valid.
+ * arrange() and any change to the client list or tags invalidate it. */
+void
+updatetiled(Monitor *m)
+{
+	unsigned int n;
+	Client *c;
+
+	if (m->tiledvalid && m->tiledtags == m->tagset[m->seltags])
+		return;
+
+	for (n = 0, c = m->clients; c; c = c->next, n++);
+	if (n > m->tiledsize) {
+		free(m->tiled);
+		m->tiledsize = n * 2;
+		m->tiled = ecalloc(m->tiledsize, sizeof(Client *));
+	}
+
+	for (m->ntiled = 0, c = m->clients; c; c = c->next) {
+		if (!c->isfloating && ISVISIBLE(c)) {
+			c->tiledidx = m->ntiled;
+			m->tiled[m->ntiled++] = c;
+		} else
+			c->tiledidx = -1;
+	}
+
+	m->tiledtags = m->tagset[m->seltags];
+	m->tiledvalid = 1;
 }
 
 void
@@ -1628,49 +2314,69 @@ showhide(Client *c)
 	}
 }
 
+/* mark m for restacking in flushmons(). */
 void
 restack(Monitor *m)
 {
-	Client *c;
-	XWindowChanges wc;
+	m->dirty |= DirtyStack;
+}
+
+void
+restackmon(Monitor *m)
+{
+	Client *c;
+	XWindowChanges wc;
 	XEvent ev;
+	Window *wins;
+	unsigned int i, n;
 
-	drawbar(m);
+	m->dirty &= ~DirtyStack;
+	m->dirty |= DirtyBar;
 
 	if (!m->sel)
 		return;
 
 	if (m->lt[m->sellt]->arrange)
 	{
-		wc.stack_mode = Below;
-		wc.sibling = m->barwin;
-		if (m->sel->isfloating && !m->sel->isfullscreen) {
-			XConfigureWindow(dpy, m->sel->win, CWSibling|CWStackMode, &wc);
-			wc.sibling = m->sel->win;
-		}
+		for (n = 0, c = m->stack; c; c = c->snext, n++);
+		wins = ecalloc(1 + n * 2, sizeof(Window));
+
+		/* top to bottom, each button window right above its client */
+		n = 0;
+		wins[n++] = m->barwin;
+		if (m->sel->isfloating && !m->sel->isfullscreen && ISVISIBLE(m->sel))
+			n = stackappend(wins, n, m->sel);
 		for (c = m->stack; c; c = c->snext)
-			if (ISVISIBLE(c) && c->isfullscreen) {
-				XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
-				wc.sibling = c->win;
-			}
-		/* XConfigureWindow(dpy, m->barwin, CWSibling|CWStackMode, &wc); */
-		/* wc.sibling = m->barwin; */
+			if (ISVISIBLE(c) && c->isfullscreen)
+				n = stackappend(wins, n, c);
 		for (c = m->stack; c; c = c->snext)
-			if (ISVISIBLE(c) && c->isfloating && !c->isfullscreen && c != m->sel) {
-				XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
-				wc.sibling = c->win;
-			}
-		for (c = m->stack; c; c = c->snext) {
-			if (ISVISIBLE(c) && !c->isfloating) {
-				XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
+			if (ISVISIBLE(c) && c->isfloating && !c->isfullscreen && c != m->sel)
+				n = stackappend(wins, n, c);
+		for (c = m->stack; c; c = c->snext)
+			if (ISVISIBLE(c) && !c->isfloating && !c->isfullscreen)
+				n = stackappend(wins, n, c);
+
+		/* only restack from the window above the first one that moved */
+		for (i = 0; i < n && i < m->nstackorder && wins[i] == m->stackorder[i]; i++);
+		if (i < n)
+			XRestackWindows(dpy, wins + (i ? i - 1 : 0), n - (i ? i - 1 : 0));
+
+		free(m->stackorder);
+		m->stackorder = wins;
+		m->nstackorder = n;
+	}
+	else
+	{
+		/* the clients aren't stacked, just keep the buttons above them */
+		wc.stack_mode = Above;
+		for (c = m->stack; c; c = c->snext)
+			if (ISVISIBLE(c) && c->buttonwin) {
 				wc.sibling = c->win;
+				XConfigureWindow(dpy, c->buttonwin, CWSibling|CWStackMode, &wc);
 			}
-		}
+		m->nstackorder = 0;
 	}
 
-	for (c = m->stack; c; c = c->snext)
-		updatewinbutton(c);
-
 	/* if (m->sel->isfloating || !m->lt[m->sellt]->arrange) { */
 	/* 	XRaiseWindow(dpy, m->sel->win); */
 	/* 	XRaiseWindow(dpy, m->sel->buttonwin); */
@@ -1685,29 +2391,65 @@ restack(Monitor *m)
 	while (XCheckMaskEvent(dpy, EnterWindowMask, &ev));
 }
 
-void
+unsigned int
+stackappend(Window *wins, unsigned int n, Client *c)
+{
+	if (c->buttonwin)
+		wins[n++] = c->buttonwin;
+	wins[n++] = c->win;
+	return n;
+}
+
+/* returns whether the window was configured */
+int
 resize(Client *c, int x, int y, int w, int h, int interact)
 {
-	if (applysizehints(c, &x, &y, &w, &h, interact) || !c->geomvalid)
-		resizeclient(c, x, y, w, h);
+	/* resizeclient() compares against what the server has, not c->x etc.,
+	 * which may have been changed without configuring the window */
+	applysizehints(c, &x, &y, &w, &h, interact);
+	return resizeclient(c, x, y, w, h);
 }
 
-void
+/* returns whether the window was configured */
+int
 resizeclient(Client *c, int x, int y, int w, int h)
 {
 	XWindowChanges wc;
+	unsigned int mask = 0;
 
-	c->geomvalid = 1;
 	c->x = wc.x = x;
 	c->y = wc.y = y;
 	c->w = wc.width = w;
 	c->h = wc.height = h;
 	wc.border_width = c->bw;
-	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
+
+	/* only send the fields that changed since the last configure */
+	if (!c->geomvalid)
+		mask = CWX|CWY|CWWidth|CWHeight|CWBorderWidth;
+	else {
+		mask |= x != c->cfgx ? CWX : 0;
+		mask |= y != c->cfgy ? CWY : 0;
+		mask |= w != c->cfgw ? CWWidth : 0;
+		mask |= h != c->cfgh ? CWHeight : 0;
+		mask |= c->bw != c->cfgbw ? CWBorderWidth : 0;
+	}
+	if (!mask)
+		return 0;
+
+	c->geomvalid = 1;
+	c->cfgx = x;
+	c->cfgy = y;
+	c->cfgw = w;
+	c->cfgh = h;
+	c->cfgbw = c->bw;
+	XConfigureWindow(dpy, c->win, mask, &wc);
 	sendconfigurenotify(c);
-	updateborder(c);
-	updatewinbutton(c);
+	if (mask & (CWWidth|CWHeight|CWBorderWidth))
+		updateborder(c);
+	if (mask & (CWX|CWY|CWWidth|CWBorderWidth))
+		updatewinbutton(c);
 	/* XSync(dpy, 0); */
+	return 1;
 }
 
 void
@@ -1770,43 +2512,43 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 		iw = *w;
 		ih = *h;
 
-		if (!c->hintsvalid)
+		if (!c->info->hintsvalid)
 			updatesizehints(c);
 
 		/* see last two sentences in ICCCM 4.1.2.3 */
-		baseismin = (c->basew == c->minw && c->baseh == c->minh);
+		baseismin = (c->info->basew == c->info->minw && c->info->baseh == c->info->minh);
 		if (!baseismin) { /* temporarily remove base dimensions */
-			*w -= c->basew;
-			*h -= c->baseh;
+			*w -= c->info->basew;
+			*h -= c->info->baseh;
 		}
 
 		/* adjust for aspect limits */
-		if (c->mina > 0 && c->maxa > 0) {
-			if (c->maxa < (float)*w / *h)
-				*w = *h * c->maxa + 0.5;
-			else if (c->mina < (float)*h / *w)
-				*h = *w * c->mina + 0.5;
+		if (c->info->mina > 0 && c->info->maxa > 0) {
+			if (c->info->maxa < (float)*w / *h)
+				*w = *h * c->info->maxa + 0.5;
+			else if (c->info->mina < (float)*h / *w)
+				*h = *w * c->info->mina + 0.5;
 		}
 
 		/* increment calculation requires this */
 		if (baseismin) {
-			*w -= c->basew;
-			*h -= c->baseh;
+			*w -= c->info->basew;
+			*h -= c->info->baseh;
 		}
 
 		/* adjust for increment value */
-		if (c->incw)
-			*w -= *w % c->incw;
-		if (c->inch)
-			*h -= *h % c->inch;
+		if (c->info->incw)
+			*w -= *w % c->info->incw;
+		if (c->info->inch)
+			*h -= *h % c->info->inch;
 
 		/* restore base dimensions */
-		*w = MAX(*w + c->basew, c->minw);
-		*h = MAX(*h + c->baseh, c->minh);
-		if (c->maxw)
-			*w = MIN(*w, c->maxw);
-		if (c->maxh)
-			*h = MIN(*h, c->maxh);
+		*w = MAX(*w + c->info->basew, c->info->minw);
+		*h = MAX(*h + c->info->baseh, c->info->minh);
+		if (c->info->maxw)
+			*w = MIN(*w, c->info->maxw);
+		if (c->info->maxh)
+			*h = MIN(*h, c->info->maxh);
 
 		if (hintcenter) {
 			if (*w < iw)
@@ -1822,75 +2564,110 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 void
 updatesizehints(Client *c)
 {
-	long msize;
-	XSizeHints size;
+	xcb_get_property_reply_t *r;
 
 	if (c->swallow)
 		return;
 
-	if (!XGetWMNormalHints(dpy, c->win, &size, &msize))
-		size.flags = PSize; /* size is uninitialized, ensure that size.flags aren't used */
+	r = replyprop(requestprop(c->win, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18));
+	setsizehints(c, r);
+	free(r);
+}
+
+/* apply a WM_NORMAL_HINTS reply, which may be NULL */
+void
+setsizehints(Client *c, xcb_get_property_reply_t *r)
+{
+	XSizeHints size = { .flags = PSize }; /* ensure that the unset fields aren't used */
+	int32_t *v;
+
+	/* see XGetWMNormalHints() */
+	if (r && r->format == 32 && r->value_len >= 15) {
+		v = xcb_get_property_value(r);
+		size.flags = v[0];
+		size.min_width = v[5];
+		size.min_height = v[6];
+		size.max_width = v[7];
+		size.max_height = v[8];
+		size.width_inc = v[9];
+		size.height_inc = v[10];
+		size.min_aspect.x = v[11];
+		size.min_aspect.y = v[12];
+		size.max_aspect.x = v[13];
+		size.max_aspect.y = v[14];
+		if (r->value_len >= 18) {
+			size.base_width = v[15];
+			size.base_height = v[16];
+			size.win_gravity = v[17];
+		} else
+			size.flags &= ~(PBaseSize|PWinGravity);
+	}
 
 	/* base size */
 	if (size.flags & PBaseSize) {
-		c->basew = size.base_width;
-		c->baseh = size.base_height;
+		c->info->basew = size.base_width;
+		c->info->baseh = size.base_height;
 	}
 	else if (size.flags & PMinSize) {
-		c->basew = size.min_width;
-		c->baseh = size.min_height;
+		c->info->basew = size.min_width;
+		c->info->baseh = size.min_height;
 	}
 	else
-		c->basew = c->baseh = 0;
+		c->info->basew = c->info->baseh = 0;
 
 	/* min size */
 	if (size.flags & PMinSize) {
-		c->minw = size.min_width;
-		c->minh = size.min_height;
+		c->info->minw = size.min_width;
+		c->info->minh = size.min_height;
 	}
 	else if (size.flags & PBaseSize) {
-		c->minw = size.base_width;
-		c->minh = size.base_height;
+		c->info->minw = size.base_width;
+		c->info->minh = size.base_height;
 	}
 	else
-		c->minw = c->minh = 0;
+		c->info->minw = c->info->minh = 0;
 
 	/* max size */
 	if (size.flags & PMaxSize) {
-		c->maxw = size.max_width;
-		c->maxh = size.max_height;
+		c->info->maxw = size.max_width;
+		c->info->maxh = size.max_height;
 	}
 	else
-		c->maxw = c->maxh = 0;
+		c->info->maxw = c->info->maxh = 0;
 
 	/* resize increments */
 	if (size.flags & PResizeInc) {
-		c->incw = size.width_inc;
-		c->inch = size.height_inc;
+		c->info->incw = size.width_inc;
+		c->info->inch = size.height_inc;
 	}
 	else
-		c->incw = c->inch = 0;
+		c->info->incw = c->info->inch = 0;
 
 	/* aspect ratio */
 	if (size.flags & PAspect) {
-		c->mina = (float)size.min_aspect.y / size.min_aspect.x;
-		c->maxa = (float)size.max_aspect.x / size.max_aspect.y;
+		c->info->mina = (float)size.min_aspect.y / size.min_aspect.x;
+		c->info->maxa = (float)size.max_aspect.x / size.max_aspect.y;
 	}
 	else
-		c->maxa = c->mina = 0.0;
+		c->info->maxa = c->info->mina = 0.0;
 
-	c->isfixed = (c->maxw && c->maxh && c->maxw == c->minw && c->maxh == c->minh);
-	c->isfloating = c->isfloating || c->isfixed;
-	c->hintsvalid = 1;
+	c->isfixed = (c->info->maxw && c->info->maxh && c->info->maxw == c->info->minw && c->info->maxh == c->info->minh);
+	if (c->isfixed && !c->isfloating) {
+		/* may happen in the middle of a layout, see applysizehints() */
+		c->isfloating = 1;
+		c->mon->tiledvalid = 0;
+	}
+	c->info->hintsvalid = 1;
 }
 
+/* restore c's tags and monitor from its _NET_WM_DESKTOP reply */
 void
-loadclienttagsandmon(Client *c)
+loadclienttagsandmon(Client *c, xcb_get_property_reply_t *r)
 {
-	unsigned int desktop, monnum;
+	uint32_t desktop, monnum;
 	Monitor *m;
 
-	if (!getcardprop(c->win, netatoms[NetWMDesktop], (long *)&desktop))
+	if (!getpropvalue(r, &desktop))
 		return;
 
 	c->tags = (1 << (desktop % LENGTH(tags))) & TAGMASK;
@@ -1904,13 +2681,13 @@ void
 loadmonsettings(void)
 {
 	Atom type;
-	int format, selnum, i = 0;
+	int format, i = 0;
 	unsigned long nitems, remaining;
-	long *value = NULL;
+	long *value = NULL, selnum = -1;
 	Monitor *m;
 
 	/* load selected monitor */
-	getcardprop(root, atoms[DWMMonSel], (long *)&selnum);
+	getcardprop(root, atoms[DWMMonSel], &selnum);
 
 	/* load tags of monitors */
 	while (XGetWindowProperty(dpy, root, atoms[DWMMonDesktop], i, 1, 0,
@@ -1933,63 +2710,169 @@ loadmonsettings(void)
 	XFree(value);
 }
 
+/* apply a WM_CLASS reply, which may be NULL */
 void
-updateclass(Client *c)
+setclass(Client *c, xcb_get_property_reply_t *r)
 {
-	XClassHint ch = { NULL, NULL };
+	const char *v;
+	int len, n;
+
+	if (!r || r->type != XA_STRING || r->format != 8) {
+		strscpy(c->info->class, broken, sizeof(c->info->class));
+		strscpy(c->info->instance, broken, sizeof(c->info->instance));
+		return;
+	}
 
-	XGetClassHint(dpy, c->win, &ch);
-	strscpy(c->class, ch.res_class ? ch.res_class : broken, sizeof(c->class));
-	strscpy(c->instance, ch.res_name ? ch.res_name : broken, sizeof(c->instance));
-	XFree(ch.res_class);
-	XFree(ch.res_name);
+	/* "instance\0class\0", see XGetClassHint() */
+	v = xcb_get_property_value(r);
+	len = xcb_get_property_value_length(r);
+	n = strnlen(v, len);
+	strsscpy(c->info->instance, v, sizeof(c->info->instance), n);
+	if (n < len)
+		strsscpy(c->info->class, v + n + 1, sizeof(c->info->class), len - n - 1);
+	else
+		c->info->class[0] = '\0';
 }
 
 void
 updatetitle(Client *c)
 {
-	if (!gettextprop(c->win, netatoms[NetWMName], c->title, sizeof(c->title)))
-		gettextprop(c->win, XA_WM_NAME, c->title, sizeof(c->title));
-	if (c->title[0] == '\0') /* hack to mark broken clients */
-		strscpy(c->title, broken, sizeof(c->title));
+	xcb_get_property_cookie_t netwmname, wmname;
+	xcb_get_property_reply_t *r1, *r2;
+
+	netwmname = requestprop(c->win, netatoms[NetWMName], XCB_GET_PROPERTY_TYPE_ANY, WinTitleSize / 4);
+	wmname = requestprop(c->win, XA_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, WinTitleSize / 4);
+	r1 = replyprop(netwmname);
+	r2 = replyprop(wmname);
+	settitle(c, r1, r2);
+	free(r1);
+	free(r2);
+}
+
+/* apply the _NET_WM_NAME and WM_NAME replies, which may be NULL */
+void
+settitle(Client *c, xcb_get_property_reply_t *netwmname, xcb_get_property_reply_t *wmname)
+{
+	if (!proptotext(netwmname, c->info->title, sizeof(c->info->title)))
+		proptotext(wmname, c->info->title, sizeof(c->info->title));
+	if (c->info->title[0] == '\0') /* hack to mark broken clients */
+		strscpy(c->info->title, broken, sizeof(c->info->title));
+	c->info->titlegen = ++titlegen;
 }
 
 void
 updatewindowtype(Client *c)
 {
-	Atom state = getatomprop(c->win, netatoms[NetWMState]);
-	Atom wtype = getatomprop(c->win, netatoms[NetWMWindowType]);
+	xcb_get_property_cookie_t state, wtype;
+	xcb_get_property_reply_t *r1, *r2;
+
+	state = requestprop(c->win, netatoms[NetWMState], XA_ATOM, 1);
+	wtype = requestprop(c->win, netatoms[NetWMWindowType], XA_ATOM, 1);
+	r1 = replyprop(state);
+	r2 = replyprop(wtype);
+	setwindowtype(c, r1, r2);
+	free(r1);
+	free(r2);
+}
+
+/* apply the _NET_WM_STATE and _NET_WM_WINDOW_TYPE replies, which may be NULL */
+void
+setwindowtype(Client *c, xcb_get_property_reply_t *state, xcb_get_property_reply_t *wtype)
+{
+	uint32_t atom;
 
-	if (wtype == netatoms[NetWMWindowTypeDialog])
+	if (getpropvalue(wtype, &atom) && atom == netatoms[NetWMWindowTypeDialog])
 		c->isfloating = 1;
-	if (state == netatoms[NetWMFullscreen])
+	if (getpropvalue(state, &atom) && atom == netatoms[NetWMFullscreen])
 		setfullscreen(c, 1);
 }
 
 void
 updatewmhints(Client *c)
 {
-	XWMHints *wmh;
+	xcb_get_property_reply_t *r;
+
+	r = replyprop(requestprop(c->win, XA_WM_HINTS, XA_WM_HINTS, 9));
+	setwmhints(c, r);
+	free(r);
+}
+
+/* apply a WM_HINTS reply, which may be NULL */
+void
+setwmhints(Client *c, xcb_get_property_reply_t *r)
+{
+	XWMHints wmh;
+	int32_t *v;
 
-	if (!(wmh = XGetWMHints(dpy, c->win)))
+	/* see XGetWMHints() */
+	if (!r || r->format != 32 || r->value_len < 8) {
+		c->info->haswmhints = 0;
 		return;
+	}
+
+	v = xcb_get_property_value(r);
+	wmh.flags = v[0];
+	wmh.input = !!v[1];
+	wmh.initial_state = v[2];
+	wmh.icon_pixmap = v[3];
+	wmh.icon_window = v[4];
+	wmh.icon_x = v[5];
+	wmh.icon_y = v[6];
+	wmh.icon_mask = v[7];
+	if (r->value_len >= 9)
+		wmh.window_group = v[8];
+	else {
+		wmh.window_group = 0;
+		wmh.flags &= ~WindowGroupHint;
+	}
 
-	if (c == selmon->sel && wmh->flags & XUrgencyHint) {
-		wmh->flags &= ~XUrgencyHint;
-		XSetWMHints(dpy, c->win, wmh);
+	if (c == selmon->sel && wmh.flags & XUrgencyHint) {
+		wmh.flags &= ~XUrgencyHint;
+		XSetWMHints(dpy, c->win, &wmh);
 	}
 	else {
-		c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
+		setisurgent(c, wmh.flags & XUrgencyHint);
 		if (c->isurgent)
-			drawborder(c->win, SchemeUrg);
+			drawborder(c, SchemeUrg);
 	}
 
-	if (wmh->flags & InputHint)
-		c->neverfocus = !wmh->input;
+	if (wmh.flags & InputHint)
+		c->neverfocus = !wmh.input;
 	else
 		c->neverfocus = 0;
 
-	XFree(wmh);
+	c->info->wmhints = wmh;
+	c->info->haswmhints = 1;
+}
+
+void
+updateprotocols(Client *c)
+{
+	xcb_get_property_reply_t *r;
+
+	r = replyprop(requestprop(c->win, atoms[WMProtocols], XA_ATOM, ProtocolsPropSize));
+	setprotocols(c, r);
+	free(r);
+}
+
+/* apply a WM_PROTOCOLS reply, which may be NULL */
+void
+setprotocols(Client *c, xcb_get_property_reply_t *r)
+{
+	uint32_t *v;
+	int i;
+
+	c->info->protocols = 0;
+	if (!r || r->format != 32)
+		return;
+
+	v = xcb_get_property_value(r);
+	for (i = 0; i < r->value_len; i++) {
+		if (v[i] == atoms[WMDelete])
+			c->info->protocols |= ProtoDelete;
+		else if (v[i] == atoms[WMTakeFocus])
+			c->info->protocols |= ProtoTakeFocus;
+	}
 }
 
 void
@@ -2011,7 +2894,7 @@ updateclientlist(void)
 		for (c = m->clients; c; c = c->next) {
 			appendtoclientlist(c->win);
 			if (c->swallow)
-				appendtoclientlist(c->origwin);
+				appendtoclientlist(c->info->origwin);
 		}
 }
 
@@ -2020,12 +2903,21 @@ updateclientdesktop(Client *c)
 {
 	unsigned int desktop = gettagnum(c->tags) + (c->mon->num * LENGTH(tags));
 
-	if (desktop != c->desktop) {
-		c->desktop = desktop;
+	if (desktop != c->info->desktop) {
+		c->info->desktop = desktop;
 		setcardprop(c->win, netatoms[NetWMDesktop], desktop);
 	}
 }
 
+void
+updatemondesktops(Monitor *m)
+{
+	Client *c;
+
+	for (c = m->clients; c; c = c->next)
+		updateclientdesktop(c);
+}
+
 void
 updatecurrentdesktop(void)
 {
@@ -2077,7 +2969,6 @@ updatewinbutton(Client *c)
 	int width = 20;
 	int height = 15;
 	int border = 2;
-	XWindowChanges wc;
 	XClassHint ch = { "winbutton", "dwm" };
 	XSetWindowAttributes swa = {
 		.override_redirect = 1,
@@ -2094,14 +2985,13 @@ updatewinbutton(Client *c)
 		XSelectInput(dpy, c->buttonwin, ButtonPressMask|EnterWindowMask|LeaveWindowMask);
 		XMapWindow(dpy, c->buttonwin);
 		setcardprop(c->buttonwin, netatoms[NetWMWindowOpacity], TRANSPARENT);
+		winmapset(c->buttonwin, c, WinButton);
 	}
 
-	if (ISVISIBLE(c)) {
-		wc.stack_mode = Above;
-		wc.sibling = c->win;
-		XConfigureWindow(dpy, c->buttonwin, CWSibling|CWStackMode, &wc);
+	/* restackmon() keeps it above c->win */
+	if (ISVISIBLE(c))
 		XMoveWindow(dpy, c->buttonwin, c->x + WIDTH(c) - width, c->y - (height / 2));
-	} else
+	else
 		XMoveWindow(dpy, c->buttonwin, WIDTH(c) * -2, c->y - 10);
 }
 
@@ -2132,8 +3022,7 @@ updatebarwin(Monitor *m)
 	}
 
 	if (m->barwin) {
-		XMoveResizeWindow(dpy, selmon->barwin,
-			selmon->wx, selmon->by, selmon->ww, barheight);
+		XMoveResizeWindow(dpy, m->barwin, m->wx, m->by, m->ww, barheight);
 	} else {
 		m->barwin = XCreateWindow(dpy, root, m->wx, m->by, m->ww, barheight, 0,
 			depth, CopyFromParent, visual,
@@ -2144,6 +3033,14 @@ updatebarwin(Monitor *m)
 		XMapRaised(dpy, m->barwin);
 	}
 
+	if (m->barpixmapw != m->ww) {
+		if (m->barpixmap)
+			XFreePixmap(dpy, m->barpixmap);
+		m->barpixmap = XCreatePixmap(dpy, root, m->ww, barheight, depth);
+		m->barpixmapw = m->ww;
+		m->bs.isvalid = 0;
+	}
+
 	if (m == STATUSMON)
 		systrayupdate(); /* systrayupdate() calls drawbar() as well */
 	else
@@ -2155,81 +3052,130 @@ updatestatustext(void)
 {
 	if (!gettextprop(root, XA_WM_NAME, statustext, sizeof(statustext)))
 		strscpy(statustext, "dwm-"VERSION, sizeof(statustext));
+	statusgen++;
 }
 
+/* mark m (or all monitors if m is NULL) for redrawing in flushmons(). */
 void
 drawbar(Monitor *m)
+{
+	if (!m) {
+		for (m = mons; m; m = m->next)
+			drawbar(m);
+		return;
+	}
+
+	m->dirty |= DirtyBar;
+}
+
+void
+drawbarmon(Monitor *m)
 {
 	const int boxs = fontheight / 9;
 	const int boxw = fontheight / 6 + 2;
-	int i, j, w, x = 0, status_x, tmpx, issel, scheme;
+	int i, j, w, x, status_x, tmpx, issel, isurg, scheme, gap;
+	int dx0, dx1; /* damaged area */
 	int cindpx = fontheight * cindfact;
-	unsigned int occ = 0; /* occupied tags */
-	unsigned int urg = 0; /* tags containing urgent clients */
+	int selpos[LENGTH(tags)]; /* indicator of the monocle client per tag */
+	unsigned int damage;
 	char biditext[StatusSize];
 	Client *c;
 
-	if (!m) {
-		for (m = mons; m; m = m->next)
-			drawbar(m);
-		return;
-	}
+	m->dirty &= ~DirtyBar;
+	prunefallbackfonts();
 
-	if (!m->showbar || barunchanged(m))
+	if (!m->showbar || !(damage = bardamage(m)))
 		return;
 
-	/* get occupied and urgent tags */
-	for (c = m->clients; c; c = c->next) {
-		occ |= c->tags;
-		if (c->isurgent)
-			urg |= c->tags;
-	}
+	rendersettarget(m->barpixmap);
+	dx0 = m->bdw;
+	dx1 = 0;
 
-	/* reset button positions to 0 */
-	m->bp = (const ButtonPos){0};
+	/* draw status first, the other segments end where it starts */
+	status_x = m->bp.statusstart;
+	if (damage & SegStatus) {
+		if (m == STATUSMON)
+			drawstatus(m);
+		else {
+			for (i = 0; i < LENGTH(statusclick); i++)
+				m->bp.modules[i].exists = 0;
+			m->bp.statusstart = m->bdw;
+		}
+		dx0 = m->bp.statusstart;
+		dx1 = m->bdw;
+
+		/* the status moved; anything it uncovered or covered must be redrawn */
+		if (m->bp.statusstart != status_x) {
+			damage |= SegTitle;
+			if (MIN(m->bp.statusstart, status_x) < m->bp.ltsymbol)
+				damage |= SegTags|SegLtSymbol;
+		}
+		status_x = m->bp.statusstart;
+	}
 
-	/* draw status first so it can be overdrawn by tags later */
-	status_x = (m == STATUSMON) ? drawstatus(m) : m->bdw;
+	renderclip(0, status_x);
 
 	/* draw tags */
-	for (i = 0; i < LENGTH(tags); i++)
-	{
-		issel = m->tagset[m->seltags] & (1 << i);
+	if (damage & SegTags) {
+		/* in monocle, the selected client's indicator is drawn wider */
+		for (i = 0; i < LENGTH(tags); i++)
+			selpos[i] = -1;
+		if (m->sel && m->lt[m->sellt]->arrange == monocle)
+			for (c = m->clients; c; c = c->next) {
+				for (i = 0; i < LENGTH(tags); i++)
+					if (c->tags & m->sel->tags & (1 << i))
+						selpos[i]++;
+				if (c == m->sel)
+					break;
+			}
 
-		/* skip vacant tags */
-		if (!issel && !(occ & (1 << i)))
-			continue;
+		gap = MAX(cindpx / 2, 1);
+		for (x = i = 0; i < LENGTH(tags); i++)
+		{
+			issel = m->tagset[m->seltags] & (1 << i);
+			isurg = m->ntagurgent[i] > 0;
 
-		/* draw tag names */
-		tmpx = x;
-		scheme = issel ? SchemeSel : SchemeNorm;
-		x = m->bp.tags[i] = RENDERTEXTWP(scheme, tags[i], x, m->bdw, urg & (1 << i));
+			/* skip vacant tags */
+			if (!issel && !m->ntagclients[i]) {
+				m->bp.tags[i] = 0;
+				continue;
+			}
 
-		/* draw client indicators */
-		for (j = 0, c = m->clients; c; c = c->next)
-		{
-			if (c->tags & (1 << i))
-			{
-				int ismonocle = (c == m->sel && m->lt[m->sellt]->arrange == monocle);
-				int gap = MAX(cindpx / 2, 1);
+			/* draw tag names */
+			tmpx = x;
+			scheme = issel ? SchemeSel : SchemeNorm;
+			x = m->bp.tags[i] = RENDERTEXTWP(scheme, tags[i], x, TEXTWP(tags[i]), isurg);
+
+			/* draw client indicators */
+			for (j = 0; j < m->ntagclients[i]; j++)
 				renderrect(scheme, tmpx + gap, (j * cindpx * 2) + gap + 1,
-					cindpx * (ismonocle ? 2.5 : 1), cindpx, 1, urg & (1 << i));
-				j++;
-			}
+					cindpx * (j == selpos[i] ? 2.5 : 1), cindpx, 1, isurg);
 		}
+
+		if (x != m->bp.tagsend)
+			damage |= SegLtSymbol;
+		dx0 = 0;
+		dx1 = MAX(dx1, MAX(x, m->bp.tagsend));
+		m->bp.tagsend = x;
 	}
-	m->bp.tagsend = x;
 
 	/* draw layout symbol */
-	x = m->bp.ltsymbol = RENDERTEXTWP(SchemeNorm, m->ltsymbol, x, m->bdw, 0);
+	if (damage & SegLtSymbol) {
+		x = m->bp.tagsend;
+		x = RENDERTEXTWP(SchemeNorm, m->ltsymbol, x, TEXTWP(m->ltsymbol), 0);
+		if (x != m->bp.ltsymbol)
+			damage |= SegTitle;
+		dx0 = MIN(dx0, m->bp.tagsend);
+		dx1 = MAX(dx1, MAX(x, m->bp.ltsymbol));
+		m->bp.ltsymbol = x;
+	}
 
 	/* draw window title if it fits */
-	if ((w = status_x - x) > barheight)
-	{
-		if (m->sel)
+	if ((damage & SegTitle) && (w = status_x - (x = m->bp.ltsymbol)) > 0) {
+		if (w > barheight && m->sel)
 		{
 			scheme = (m == selmon) ? SchemeTitle : SchemeNorm;
-			fribidi(biditext, m->sel->title, sizeof(m->sel->title));
+			fribidi(biditext, m->sel->info->title, sizeof(m->sel->info->title));
 			RENDERTEXTWP(scheme, biditext, x, w, 0);
 
 			/* draw a floating indicator */
@@ -2238,56 +3184,67 @@ drawbar(Monitor *m)
 		}
 		else
 			renderrect(SchemeNorm, x, 0, w, barheight, 1, 1);
+		dx0 = MIN(dx0, x);
+		dx1 = MAX(dx1, status_x);
 	}
 
-	rendermap(m, status_x, 0);
+	renderclip(0, 0);
+
+	if (dx1 > dx0)
+		rendermap(m, dx0, MIN(dx1, m->bdw) - dx0);
 }
 
-int
-barunchanged(Monitor *m)
+/* compare the bar's state against what was last drawn and return the
+ * segments that need to be redrawn */
+unsigned int
+bardamage(Monitor *m)
 {
-	unsigned int n, selpos = 0, occ = 0, urg = 0;
-	Client *c;
+	unsigned int damage = 0;
+	int ismonocle = (m->lt[m->sellt]->arrange == monocle);
+	int isfloating = (m->sel && m->sel->isfloating && !m->sel->isfullscreen);
 
-	for (n = 0, c = m->clients; c; c = c->next, n++) {
-		occ |= c->tags;
-		if (c->isurgent)
-			urg |= c->tags;
-		if (c == m->sel)
-			selpos = n;
-	}
-
-	if (m->bs.nclients == n
-		&& m->bs.tags == m->tagset[m->seltags]
-		&& m->bs.occtags == occ
-		&& m->bs.urgtags == urg
-		&& m->bs.bdw == m->bdw
-		&& !!m->bs.isselmon == !!(m == selmon)
-		&& !!m->bs.isstatusmon == !!(m == STATUSMON)
-		&& !!m->bs.title[0] == !!(m->sel)
-		&& (!m->sel || m->bs.isfloating == m->sel->isfloating)
-		&& (m->lt[m->sellt]->arrange != monocle || m->bs.selpos == selpos)
-		&& strncmp(m->bs.ltsymbol, m->ltsymbol, sizeof(m->ltsymbol)) == 0
-		&& (!m->sel || strncmp(m->bs.title, m->sel->title, sizeof(m->sel->title)) == 0)
-		&& (m != STATUSMON || strncmp(m->bs.statustext, statustext, sizeof(statustext)) == 0))
-	{
-		return 1;
-	}
+	if (!m->bs.isvalid || m->bs.bdw != m->bdw)
+		damage = SegAll;
 
-	m->bs.nclients = n;
-	m->bs.tags = m->tagset[m->seltags];
-	m->bs.occtags = occ;
-	m->bs.urgtags = urg;
-	m->bs.selpos = selpos;
+	if (m->bs.tags != m->tagset[m->seltags]
+		|| m->bs.occgen != m->occgen
+		|| m->bs.urggen != m->urggen
+		|| m->bs.ismonocle != ismonocle
+		|| (ismonocle && m->bs.sel != m->sel))
+		damage |= SegTags;
+
+	if (m->bs.ltgen != m->ltgen)
+		damage |= SegLtSymbol;
+
+	if (m->bs.titlegen != (m->sel ? m->sel->info->titlegen : 0)
+		|| !!m->bs.isselmon != !!(m == selmon)
+		|| m->bs.isfloating != isfloating
+		|| m->bs.isfixed != (m->sel && m->sel->isfixed))
+		damage |= SegTitle;
+
+	if (!!m->bs.isstatusmon != !!(m == STATUSMON)
+		|| (m == STATUSMON && m->bs.statusgen != statusgen))
+		damage |= SegStatus;
+
+	if (!damage)
+		return 0;
+
+	m->bs.isvalid = 1;
 	m->bs.bdw = m->bdw;
+	m->bs.tags = m->tagset[m->seltags];
+	m->bs.occgen = m->occgen;
+	m->bs.urggen = m->urggen;
+	m->bs.ismonocle = ismonocle;
+	m->bs.sel = m->sel;
+	m->bs.ltgen = m->ltgen;
+	m->bs.titlegen = m->sel ? m->sel->info->titlegen : 0;
 	m->bs.isselmon = (m == selmon);
+	m->bs.isfloating = isfloating;
+	m->bs.isfixed = (m->sel && m->sel->isfixed);
 	m->bs.isstatusmon = (m == STATUSMON);
-	m->bs.isfloating = (m->sel && m->sel->isfloating);
-	strscpy(m->bs.ltsymbol, m->ltsymbol, sizeof(m->bs.ltsymbol));
-	strscpy(m->bs.statustext, statustext, sizeof(m->bs.statustext));
-	strscpy(m->bs.title, m->sel ? m->sel->title : "\0", sizeof(m->bs.title));
+	m->bs.statusgen = statusgen;
 
-	return 0;
+	return damage;
 }
 
 void
@@ -2298,6 +3255,7 @@ buttonpress(XEvent *e)
 	Monitor *m;
 	XButtonPressedEvent *ev = &e->xbutton;
 	unsigned int i = 0, click = ClickInvalid, clickalt = ClickInvalid;
+	int b, pos = -1;
 	static ClickEv lastclick = { .isvalid = 0 };
 
 	/* focus monitor if necessary */
@@ -2371,38 +3329,49 @@ buttonpress(XEvent *e)
 	if (click == ClickClientWin || click == ClickRootWin)
 		clickalt = ClickWinArea;
 
-	for (i = 0; i < LENGTH(buttons); i++)
-		if ((buttons[i].click == click || buttons[i].click == clickalt)
-			&& buttons[i].func
-			&& buttons[i].button == ev->button
-			&& CLEANMASK(buttons[i].mod) == CLEANMASK(ev->state))
-		{
+	while ((b = dispatchfind(&buttondispatch, ev->button, CLEANMASK(ev->state), &pos)) >= 0)
+		if (buttons[b].click == click || buttons[b].click == clickalt) {
 			lastclick.isvalid = 0;
-			buttons[i].func(click == ClickTagBar && buttons[i].arg.i == 0 ? &arg : &buttons[i].arg);
+			buttons[b].func(click == ClickTagBar && buttons[b].arg.i == 0 ? &arg : &buttons[b].arg);
 		}
 }
 
 void
 handlestatusclick(Monitor *m, XButtonPressedEvent *ev)
 {
-	for (int i = 0; i < LENGTH(statusclick); i++)
+	int i, pos = -1;
+
+	while ((i = dispatchfind(&statusdispatch, ev->button, CLEANMASK(ev->state), &pos)) >= 0)
 		if (m->bp.modules[i].exists
 		&& ev->x > m->bp.modules[i].start
-		&& ev->x < m->bp.modules[i].end
-		&& statusclick[i].func
-		&& statusclick[i].button == ev->button
-		&& CLEANMASK(statusclick[i].mod) == CLEANMASK(ev->state))
+		&& ev->x < m->bp.modules[i].end)
 		{
 			statusclick[i].func(&statusclick[i].arg);
 		}
 }
 
+/* measure the status, then draw it right-aligned on the bar */
 int
 drawstatus(Monitor *m)
+{
+	int status_w = MIN(parsestatus(m, 0, 0) + (fontheight / 5), m->bdw / 1.5);
+
+	m->bp.statusstart = m->bdw - status_w;
+	renderclip(m->bp.statusstart, status_w);
+	renderrect(SchemeStatus, m->bp.statusstart, 0, status_w, barheight, 1, 1);
+	parsestatus(m, m->bp.statusstart, 1);
+
+	return m->bp.statusstart;
+}
+
+/* walk the status text starting at x, recording the positions of the
+ * clickable modules, and draw it if render is set. returns the end x. */
+int
+parsestatus(Monitor *m, int x, int render)
 {
 	char c, modulename[64] = {'\0'}, normaltext[LENGTH(statustext)] = {'\0'};
-	int x = 0, pos = 0, normalstartpos = 0, tagstartpos = 0, skiptag = 0;
-	int i, islastchar, status_w, status_x, modulestart_x = 0;
+	int pos = 0, normalstartpos = 0, tagstartpos = 0, skiptag = 0;
+	int i, islastchar, modulestart_x = x;
 	enum Mode { Normal, Tag, };
 	enum Mode mode = Normal;
 
@@ -2454,7 +3423,8 @@ finaldraw:
 
 			/* draw any normaltext up to here */
 			if (normaltext[0])
-				x = rendertext(SchemeStatus, normaltext, x, 0, m->bdw, barheight, 0, 0);
+				x = render ? rendertext(SchemeStatus, normaltext, x, 0, 0, barheight, 0, 0)
+					: x + rendergettextwidth(normaltext);
 
 			/* record module's start and end x coord */
 			for (i = 0; i < LENGTH(statusclick); i++)
@@ -2470,7 +3440,8 @@ finaldraw:
 			/* draw the seaprator char */
 			normaltext[0] = c;
 			normaltext[1] = '\0';
-			x = rendertext(SchemeStatusSep, normaltext, x, 0, m->bdw, barheight, 0, 0);
+			x = render ? rendertext(SchemeStatusSep, normaltext, x, 0, 0, barheight, 0, 0)
+				: x + rendergettextwidth(normaltext);
 			modulestart_x = x;
 
 			/* reset the normaltext buffer */
@@ -2483,18 +3454,7 @@ finaldraw:
 	goto finaldraw;
 finaldraw_end:
 
-	status_w = MIN(x + (fontheight / 5), m->bdw / 1.5);
-	status_x = m->bp.statusstart = m->bdw - status_w;
-	renderrect(SchemeNorm, status_x + status_w, 0, m->bdw, barheight, 1, 0);
-	rendermap(m, status_w, status_x);
-
-	for (i = 0; i < LENGTH(statusclick); i++)
-		if (m->bp.modules[i].exists) {
-			m->bp.modules[i].start += status_x;
-			m->bp.modules[i].end += status_x;
-		}
-
-	return status_x;
+	return x;
 }
 
 int
@@ -2508,22 +3468,39 @@ isseparator(char c)
 }
 
 void
-drawborder(Window win, int scm)
+drawborder(Client *c, int scm)
+{
+	if (c->bw)
+		XSetWindowBorderPixmap(dpy, c->win,
+			getborderpixmap(c->w, c->h, c->bw, c->depth, scm));
+}
+
+/* returns the border pixmap of a window, drawing it if it isn't cached.
+ * the least recently used pixmap makes room for it. */
+Pixmap
+getborderpixmap(int w, int h, int bw, int depth, int scm)
 {
-	int w, h;   /* window width and height */
-	int pw, ph; /* pixmap width and height */
+	int i, pw, ph; /* pixmap width and height */
 	int innerpx, inneroffset, innersum;
-	XWindowAttributes wa;
-	Pixmap borderpixmap;
+	BorderPixmap *bp = &borderpixmaps[0];
 	GC bordergc;
 
-	if (!XGetWindowAttributes(dpy, win, &wa) || !wa.border_width)
-		return;
+	for (i = 0; i < LENGTH(borderpixmaps); i++) {
+		if (borderpixmaps[i].pixmap
+		 && borderpixmaps[i].w == w && borderpixmaps[i].h == h
+		 && borderpixmaps[i].bw == bw && borderpixmaps[i].depth == depth
+		 && borderpixmaps[i].scm == scm)
+		{
+			borderpixmaps[i].lastused = ++borderclock;
+			return borderpixmaps[i].pixmap;
+		}
+		if (bp->pixmap && (!borderpixmaps[i].pixmap
+		 || borderpixmaps[i].lastused < bp->lastused))
+			bp = &borderpixmaps[i];
+	}
 
-	w = wa.width;
-	h = wa.height;
-	pw = w + (wa.border_width * 2);
-	ph = h + (wa.border_width * 2);
+	pw = w + (bw * 2);
+	ph = h + (bw * 2);
 	innerpx = innerborderpx;
 	inneroffset = innerborderoffsetpx;
 	innersum = innerpx + inneroffset;
@@ -2546,20 +3523,48 @@ drawborder(Window win, int scm)
 		{ pw-inneroffset, h+inneroffset,  inneroffset,   innerpx     }, /* 8 - down and to the left of the window, left of 1 and right of 4 */
 	};
 
-	borderpixmap = XCreatePixmap(dpy, win, pw, ph, wa.depth);
-	bordergc = XCreateGC(dpy, borderpixmap, 0, NULL);
+	/* windows using an evicted pixmap keep their own reference to it */
+	if (bp->pixmap)
+		XFreePixmap(dpy, bp->pixmap);
+	bp->w = w;
+	bp->h = h;
+	bp->bw = bw;
+	bp->depth = depth;
+	bp->scm = scm;
+	bp->lastused = ++borderclock;
+	bp->pixmap = XCreatePixmap(dpy, root, pw, ph, depth);
+	bordergc = getbordergc(depth, bp->pixmap);
 
 	/* fill the area with the border background color */
 	XSetForeground(dpy, bordergc, schemes[scm][ColorBorderBG].pixel);
-	XFillRectangle(dpy, borderpixmap, bordergc, 0, 0, pw, ph);
+	XFillRectangle(dpy, bp->pixmap, bordergc, 0, 0, pw, ph);
 
 	/* draw the inner border on top of the previous fill */
 	XSetForeground(dpy, bordergc, schemes[scm][ColorBorder].pixel);
-	XFillRectangles(dpy, borderpixmap, bordergc, rectangles, LENGTH(rectangles));
+	XFillRectangles(dpy, bp->pixmap, bordergc, rectangles, LENGTH(rectangles));
+
+	return bp->pixmap;
+}
+
+/* returns the gc for drawing border pixmaps of the given depth,
+ * creating it on d if there is none yet */
+GC
+getbordergc(int depth, Drawable d)
+{
+	int i;
 
-	XSetWindowBorderPixmap(dpy, win, borderpixmap);
-	XFreePixmap(dpy, borderpixmap);
-	XFreeGC(dpy, bordergc);
+	for (i = 0; i < LENGTH(bordergcs) && bordergcs[i].gc; i++)
+		if (bordergcs[i].depth == depth)
+			return bordergcs[i].gc;
+
+	/* a screen has only a handful of depths, but replace the last one
+	 * rather than fail if there are more */
+	if (i == LENGTH(bordergcs))
+		XFreeGC(dpy, bordergcs[--i].gc);
+	bordergcs[i].depth = depth;
+	bordergcs[i].gc = XCreateGC(dpy, d, 0, NULL);
+
+	return bordergcs[i].gc;
 }
 
 void
@@ -2577,7 +3582,7 @@ updateborder(Client *c)
 	else
 		scm = SchemeNorm;
 
-	drawborder(c->win, scm);
+	drawborder(c, scm);
 }
 
 void
@@ -2635,12 +3640,13 @@ systrayaddicon(Window w)
 	if (!systrayinit())
 		return;
 
-	c = ecalloc(1, sizeof(Client));
+	c = createclient();
 	c->next = systray->icons;
 	systray->icons = c;
 
 	c->win = w;
 	c->mon = STATUSMON;
+	winmapset(c->win, c, WinSystrayIcon);
 
 	XAddToSaveSet(dpy, c->win);
 	XSelectInput(dpy, c->win, StructureNotifyMask|PropertyChangeMask|ResizeRedirectMask);
@@ -2696,7 +3702,8 @@ systrayremoveicon(Client *c)
 	for (tc = &systray->icons; *tc && *tc != c; tc = &(*tc)->next);
 	*tc = c->next;
 
-	free(c);
+	winmapdel(c->win);
+	freeclient(c);
 	systrayupdate();
 }
 
@@ -2756,50 +3763,74 @@ systraycleanup(void)
 	for (c = systray->icons; c;) {
 		f = c;
 		c = c->next;
-		free(f);
+		freeclient(f);
 	}
 
 	free(systray);
 }
 
-unsigned int
-getwinpid(Window w)
+#ifdef __linux__
+/* ask for the pids of the clients owning n windows in a single request */
+xcb_res_query_client_ids_cookie_t
+requestwinpids(const Window *wins, int n)
 {
-	int pid = 0;
+	xcb_res_query_client_ids_cookie_t cookie;
+	xcb_res_client_id_spec_t *specs;
+	int i;
 
-#ifdef __OpenBSD__
-	getcardprop(w, netatoms[NetWMPID], (long *)&pid);
-#endif /* __OpenBSD__ */
+	specs = ecalloc(MAX(n, 1), sizeof(xcb_res_client_id_spec_t));
+	for (i = 0; i < n; i++) {
+		specs[i].client = wins[i];
+		specs[i].mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID;
+	}
+	cookie = xcb_res_query_client_ids(xcon, n, specs);
+	free(specs);
+	return cookie;
+}
 
-#ifdef __linux__
-	xcb_res_query_client_ids_cookie_t cookie;
+/* set pids[i] to the pid of the client owning wins[i], or 0 if unknown */
+void
+replywinpids(xcb_res_query_client_ids_cookie_t cookie, const Window *wins,
+	unsigned int *pids, int n)
+{
+	uint32_t idmask = xcb_get_setup(xcon)->resource_id_mask;
 	xcb_res_query_client_ids_reply_t *reply;
 	xcb_res_client_id_value_iterator_t iter;
-	xcb_generic_error_t *error = NULL;
-	xcb_res_client_id_spec_t spec = {0};
+	int i, pid;
 
-	spec.client = w;
-	spec.mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID;
-	cookie = xcb_res_query_client_ids(xcon, 1, &spec);
-	reply = xcb_res_query_client_ids_reply(xcon, cookie, &error);
+	for (i = 0; i < n; i++)
+		pids[i] = 0;
 
-	if (!reply)
-		return 0;
+	if (!(reply = xcb_res_query_client_ids_reply(xcon, cookie, NULL)))
+		return;
 
+	/* the values come back keyed by the resource base of the owning
+	 * client, not by the window they were asked for with */
 	iter = xcb_res_query_client_ids_ids_iterator(reply);
 	for (; iter.rem; xcb_res_client_id_value_next(&iter)) {
-		spec = iter.data->spec;
-		if (spec.mask & XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID) {
-			pid = *(int *)xcb_res_client_id_value_value(iter.data);
-			break;
-		}
+		if (!(iter.data->spec.mask & XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID)
+		|| (pid = *(int *)xcb_res_client_id_value_value(iter.data)) <= 0)
+			continue;
+		for (i = 0; i < n; i++)
+			if ((wins[i] & ~idmask) == iter.data->spec.client)
+				pids[i] = pid;
 	}
 
 	free(reply);
-#endif /* __linux__ */
+}
+#else
+unsigned int
+getwinpid(Window w)
+{
+	long pid = 0;
+
+#ifdef __OpenBSD__
+	getcardprop(w, netatoms[NetWMPID], &pid);
+#endif /* __OpenBSD__ */
 
 	return pid < 0 ? 0 : (unsigned int)pid;
 }
+#endif /* __linux__ */
 
 Client *
 getparentterminal(Client *c)
@@ -2807,19 +3838,19 @@ getparentterminal(Client *c)
 	Client *t;
 	Monitor *m;
 
-	if (!c->pid || c->isterminal)
+	if (!c->info->pid || c->info->isterminal)
 		return NULL;
 
-	if ((t = selmon->sel) && t->isterminal &&
-		!t->swallow && t->pid && isdescprocess(t->pid, c->pid))
+	if ((t = selmon->sel) && t->info->isterminal &&
+		!t->swallow && t->info->pid && isdescprocess(t->info->pid, c->info->pid))
 	{
 		return t;
 	}
 
 	for (m = mons; m; m = m->next)
 		for (t = m->clients; t; t = t->next)
-			if (t != selmon->sel && t->isterminal &&
-			    !t->swallow && t->pid && isdescprocess(t->pid, c->pid))
+			if (t != selmon->sel && t->info->isterminal &&
+			    !t->swallow && t->info->pid && isdescprocess(t->info->pid, c->info->pid))
 				return t;
 
 	return NULL;
@@ -2913,76 +3944,176 @@ pertagpop(Monitor *m)
 	}
 }
 
-Client *
-wintoclient(Window w)
+/* the layout in effect on tags, read without loading them. the state of
+ * the loaded tags lives in the monitor, not in m->pertag. */
+const Layout *
+pertaglayout(Monitor *m, unsigned int tags)
 {
-	Client *c;
-	Monitor *m;
+	unsigned int tagnum = gettagnum(tags);
 
-	if (selmon->sel && selmon->sel->win == w)
-		return selmon->sel;
+	if (!pertag || tagnum == gettagnum(m->pertagstack[m->pertagtop]))
+		return m->lt[m->sellt];
+	return m->pertag[tagnum].lt[m->pertag[tagnum].sellt];
+}
 
-	if (ISUTILWIN(w))
-		return NULL;
+/* the nmaster in effect on tags, see pertaglayout() */
+int
+pertagnmaster(Monitor *m, unsigned int tags)
+{
+	unsigned int tagnum = gettagnum(tags);
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->win == w)
-				return c;
+	if (!pertag || tagnum == gettagnum(m->pertagstack[m->pertagtop]))
+		return m->nmaster;
+	return m->pertag[tagnum].nmaster;
+}
 
-	return NULL;
+Client *
+wintoclient(Window w)
+{
+	return winmapget(w, WinClient);
 }
 
 Client *
 origwintoclient(Window w)
 {
-	Client *c;
-	Monitor *m;
-
-	if ((c = selmon->sel) && c->swallow && c->origwin == w)
-		return c;
+	return winmapget(w, WinOrig);
+}
 
-	if (ISUTILWIN(w))
-		return NULL;
+Client *
+winbuttontoclient(Window w)
+{
+	return winmapget(w, WinButton);
+}
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->swallow && c->origwin == w)
-				return c;
+Client *
+wintosystrayicon(Window w)
+{
+	return winmapget(w, WinSystrayIcon);
+}
 
-	return NULL;
+/* the window to client map is an open addressing hash table with linear
+ * probing. every window that the event handlers look up is in there, along
+ * with its role, so that a lookup doesn't have to walk the client lists. */
+unsigned int
+winmaphash(Window w)
+{
+	return (w * 2654435761UL) & (winmap.size - 1);
 }
 
 Client *
-winbuttontoclient(Window w)
+winmapget(Window w, int role)
 {
-	Client *c;
-	Monitor *m;
-
-	if (selmon->sel && selmon->sel->buttonwin == w)
-		return selmon->sel;
+	unsigned int i;
 
-	if (ISUTILWIN(w))
+	if (!winmap.len)
 		return NULL;
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->buttonwin == w)
-				return c;
+	for (i = winmaphash(w); winmap.list[i].role; i = (i + 1) & (winmap.size - 1))
+		if (winmap.list[i].win == w)
+			return winmap.list[i].role == role ? winmap.list[i].c : NULL;
 
 	return NULL;
 }
 
-Client *
-wintosystrayicon(Window w)
+/* add w to the map, or update it if it's already there. */
+void
+winmapset(Window w, Client *c, int role)
 {
-	Client *c;
+	unsigned int i, oldsize;
+	struct WinMapEntry *oldlist;
 
-	if (!systray || ISUTILWIN(w))
-		return NULL;
+	/* keep the load factor below 1/2 */
+	if ((winmap.len + 1) * 2 > winmap.size) {
+		oldlist = winmap.list;
+		oldsize = winmap.size;
+		winmap.size = oldsize ? oldsize * 2 : WinMapInitSize;
+		winmap.list = ecalloc(winmap.size, sizeof(*winmap.list));
+		winmap.len = 0;
+		for (i = 0; i < oldsize; i++)
+			if (oldlist[i].role)
+				winmapset(oldlist[i].win, oldlist[i].c, oldlist[i].role);
+		free(oldlist);
+	}
 
-	for (c = systray->icons; c && c->win != w; c = c->next);
-	return c;
+	for (i = winmaphash(w); winmap.list[i].role; i = (i + 1) & (winmap.size - 1))
+		if (winmap.list[i].win == w)
+			break;
+
+	if (!winmap.list[i].role)
+		winmap.len++;
+	winmap.list[i].win = w;
+	winmap.list[i].c = c;
+	winmap.list[i].role = role;
+}
+
+void
+winmapdel(Window w)
+{
+	unsigned int i, j, h, mask = winmap.size - 1;
+
+	if (!winmap.len)
+		return;
+
+	for (i = winmaphash(w); winmap.list[i].role && winmap.list[i].win != w; i = (i + 1) & mask);
+	if (!winmap.list[i].role)
+		return;
+
+	winmap.list[i].role = WinNone;
+	winmap.len--;
+
+	/* move back the following entries of the probe sequence that can't
+	 * be reached anymore, instead of leaving a tombstone behind. */
+	for (j = (i + 1) & mask; winmap.list[j].role; j = (j + 1) & mask) {
+		h = winmaphash(winmap.list[j].win);
+		if ((i < j) ? (h <= i || h > j) : (h <= i && h > j)) {
+			winmap.list[i] = winmap.list[j];
+			winmap.list[j].role = WinNone;
+			i = j;
+		}
+	}
+}
+
+unsigned int
+dispatchhash(unsigned int code, unsigned int mod)
+{
+	return ((code << 8 | mod) * 2654435761UL) & (DispatchSize - 1);
+}
+
+void
+dispatchclear(Dispatch *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < DispatchSize; i++)
+		d->list[i].index = -1;
+}
+
+/* linear probing keeps the duplicates of a binding in insertion order */
+void
+dispatchadd(Dispatch *d, unsigned int code, unsigned int mod, int index)
+{
+	unsigned int i;
+
+	for (i = dispatchhash(code, mod); d->list[i].index >= 0; i = (i + 1) & (DispatchSize - 1));
+	d->list[i].code = code;
+	d->list[i].mod = mod;
+	d->list[i].index = index;
+}
+
+/* returns the next binding of code and mod after *pos, which starts as -1,
+ * or -1 if there is none left */
+int
+dispatchfind(const Dispatch *d, unsigned int code, unsigned int mod, int *pos)
+{
+	unsigned int i = *pos < 0 ? dispatchhash(code, mod) : (*pos + 1) & (DispatchSize - 1);
+
+	for (; d->list[i].index >= 0; i = (i + 1) & (DispatchSize - 1))
+		if (d->list[i].code == code && d->list[i].mod == mod) {
+			*pos = i;
+			return d->list[i].index;
+		}
+
+	return -1;
 }
 
 Monitor *
@@ -3140,7 +4271,9 @@ tag(const Arg *arg)
 {
 	if (selmon->sel && arg->ui & TAGMASK) {
 		tagreduced(selmon->sel, 0, arg->ui & TAGMASK);
+		counttags(selmon->sel, -1);
 		selmon->sel->tags = arg->ui & TAGMASK;
+		counttags(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -3156,7 +4289,9 @@ toggletag(const Arg *arg)
 	newtags = selmon->sel->tags ^ (arg->ui & TAGMASK);
 	if (newtags) {
 		tagreduced(selmon->sel, 0, newtags);
+		counttags(selmon->sel, -1);
 		selmon->sel->tags = newtags;
+		counttags(selmon->sel, 1);
 		focus(NULL);
 		arrange(selmon);
 	}
@@ -3205,8 +4340,7 @@ push(const Arg *arg)
 	{
 		if ((c = nexttiled(sel->next))) {
 			detach(sel);
-			sel->next = c->next;
-			c->next = sel;
+			attachafter(sel, c);
 		}
 		else {
 			detach(sel);
@@ -3218,19 +4352,11 @@ push(const Arg *arg)
 	{
 		if ((c = prevtiled(sel))) {
 			detach(sel);
-			sel->next = c;
-			if (selmon->clients == c)
-				selmon->clients = sel;
-			else {
-				for (c = selmon->clients; c->next != sel->next; c = c->next);
-				c->next = sel;
-			}
+			attachafter(sel, c->prev);
 		}
 		else {
-			for (c = sel; c->next; c = c->next);
 			detach(sel);
-			sel->next = NULL;
-			c->next = sel;
+			attachbottom(sel);
 		}
 	}
 
@@ -3241,29 +4367,19 @@ push(const Arg *arg)
 void
 switchcol(const Arg *arg)
 {
-	Client *c, *t;
-	int col = 0;
-	int i;
+	Client *c;
+	int col;
 
 	if (!selmon->sel)
 		return;
 
-	for (i = 0, c = nexttiled(selmon->clients); c;
-	     c = nexttiled(c->next), i++)
-	{
-		if (c == selmon->sel)
-			col = (i + 1) > selmon->nmaster;
-	}
-
-	if (i <= selmon->nmaster)
+	updatetiled(selmon);
+	if (selmon->ntiled <= selmon->nmaster)
 		return;
+	col = selmon->sel->tiledidx >= selmon->nmaster;
 
 	for (c = selmon->stack; c; c = c->snext) {
-		if (!ISVISIBLE(c))
-			continue;
-		for (i = 0, t = nexttiled(selmon->clients); t && t != c;
-		     t = nexttiled(t->next), i++);
-		if (t && (i + 1 > selmon->nmaster) != col) {
+		if (c->tiledidx >= 0 && (c->tiledidx >= selmon->nmaster) != col) {
 			focus(c);
 			restack(selmon);
 			break;
@@ -3380,21 +4496,17 @@ zoom(const Arg *arg)
 void
 transfer(const Arg *arg)
 {
-	Client *c, *mtail = selmon->clients, *stail = NULL, *insertafter;
-	int transfertostack = 0, nmasterclients = 0, i;
+	Client *mtail = selmon->clients, *stail = NULL, *insertafter;
+	int transfertostack = 0, i;
 
-	for (i = 0, c = selmon->clients; c; c = c->next) {
-		if (!ISVISIBLE(c) || c->isfloating)
-			continue;
-		if (selmon->sel == c)
-			transfertostack = i < selmon->nmaster && selmon->nmaster != 0;
-		if (i < selmon->nmaster) {
-			nmasterclients++;
-			mtail = c;
-		}
-		stail = c;
-		i++;
+	updatetiled(selmon);
+	if ((i = selmon->ntiled)) {
+		if (selmon->nmaster > 0)
+			mtail = selmon->tiled[MIN(i, selmon->nmaster) - 1];
+		stail = selmon->tiled[i - 1];
 	}
+	if (selmon->sel && selmon->sel->tiledidx >= 0)
+		transfertostack = selmon->sel->tiledidx < selmon->nmaster;
 
 	if (!selmon->sel || selmon->sel->isfloating || i == 0) {
 		return;
@@ -3413,10 +4525,8 @@ transfer(const Arg *arg)
 		if (selmon->nmaster == 1 && !transfertostack) {
 			attach(selmon->sel); /* head prepend case */
 		}
-		else {
-			selmon->sel->next = insertafter->next;
-			insertafter->next = selmon->sel;
-		}
+		else
+			attachafter(selmon->sel, insertafter);
 	}
 
 	arrange(selmon);
@@ -3428,6 +4538,7 @@ spawn(const Arg *arg)
 	if (fork() == 0) {
 		if (dpy)
 			close(ConnectionNumber(dpy));
+		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
 		setsid();
 		int fd = open("/dev/null", O_WRONLY);
 		dup2(fd, STDOUT_FILENO);
@@ -3450,15 +4561,6 @@ restart(const Arg *arg)
 	running = 0;
 }
 
-void
-sigrestart(int unused)
-{
-	restart(NULL);
-	/* generate a destroynotify so that the event loop realizes it has to quit */
-	XDestroyWindow(dpy, createsimplewin());
-	XFlush(dpy);
-}
-
 #ifdef BACKTRACE
 void
 sigbacktrace(int sig)
@@ -3473,14 +4575,6 @@ sigbacktrace(int sig)
 }
 #endif /* BACKTRACE */
 
-void
-sigchld(int unused)
-{
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		die("can't install SIGCHLD handler:");
-	while (0 < waitpid(-1, NULL, WNOHANG));
-}
-
 void
 movemouse(const Arg *arg)
 {
@@ -3505,6 +4599,7 @@ movemouse(const Arg *arg)
 	}
 
 	do {
+		flushmons();
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
 
 		switch(ev.type) {
@@ -3582,6 +4677,7 @@ resizemouse(const Arg *arg)
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 
 	do {
+		flushmons();
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
 
 		switch(ev.type) {
@@ -3635,26 +4731,26 @@ setfullscreen(Client *c, int fullscreen)
 {
 	if (fullscreen && !c->isfullscreen) {
 		c->isfullscreen = 1;
-		c->oldfloating = c->isfloating;
+		c->info->oldfloating = c->isfloating;
 		c->isfloating = 1;
 		c->oldbw = c->bw;
 		c->bw = 0;
-		c->oldx = c->x;
-		c->oldy = c->y;
-		c->oldw = c->w;
-		c->oldh = c->h;
+		c->info->oldx = c->x;
+		c->info->oldy = c->y;
+		c->info->oldw = c->w;
+		c->info->oldh = c->h;
 		setfullscreenprop(c->win, 1);
 		if (!ISVISIBLE(c))
 			seturgent(c, 1);
 		arrange(c->mon);
 	} else if (!fullscreen && c->isfullscreen) {
 		c->isfullscreen = 0;
-		c->isfloating = c->oldfloating;
+		c->isfloating = c->info->oldfloating;
 		c->bw = c->oldbw;
-		c->x = c->oldx;
-		c->y = c->oldy;
-		c->w = c->oldw;
-		c->h = c->oldh;
+		c->x = c->info->oldx;
+		c->y = c->info->oldy;
+		c->w = c->info->oldw;
+		c->h = c->info->oldh;
 		c->geomvalid = 0;
 		setfullscreenprop(c->win, 0);
 		arrange(c->mon);
@@ -3664,51 +4760,100 @@ setfullscreen(Client *c, int fullscreen)
 void
 grabbuttons(Client *c, int focused)
 {
-	updatenumlockmask();
+	unsigned int i;
+	int state = focused ? GrabFocused : GrabUnfocused;
 
-	{
-		unsigned int i, j;
-		unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
+	if (c->grabstate == state)
+		return;
+	c->grabstate = state;
 
-		XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
+	/* the catch-all grab can't be ungrabbed on its own, and it has to be
+	 * grabbed before the specific grabs, which would be shadowed otherwise */
+	XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
+
+	if (!focused)
+		XGrabButton(dpy, AnyButton, AnyModifier, c->win, 0,
+			BUTTONMASK, GrabModeSync, GrabModeSync, None, None);
+
+	for (i = 0; i < nbuttongrabs; i++)
+		XGrabButton(dpy, buttongrabs[i].button, buttongrabs[i].mod,
+			c->win, 0, BUTTONMASK,
+			GrabModeAsync, GrabModeSync, None, None);
+}
+
+/* client window button grabs, expanded over the lock modifiers,
+ * and the button dispatch tables */
+void
+updatebuttongrabs(void)
+{
+	unsigned int i, j, k, mod;
+	unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
+
+	dispatchclear(&buttondispatch);
+	for (i = 0; i < LENGTH(buttons); i++)
+		if (buttons[i].func)
+			dispatchadd(&buttondispatch, buttons[i].button, CLEANMASK(buttons[i].mod), i);
 
-		if (!focused)
-			XGrabButton(dpy, AnyButton, AnyModifier, c->win, 0,
-				BUTTONMASK, GrabModeSync, GrabModeSync, None, None);
+	dispatchclear(&statusdispatch);
+	for (i = 0; i < LENGTH(statusclick); i++)
+		if (statusclick[i].func)
+			dispatchadd(&statusdispatch, statusclick[i].button, CLEANMASK(statusclick[i].mod), i);
 
-		for (i = 0; i < LENGTH(buttons); i++)
-			if (buttons[i].click == ClickClientWin
-			 || buttons[i].click == ClickWinArea)
-				for (j = 0; j < LENGTH(modifiers); j++)
-					XGrabButton(dpy, buttons[i].button,
-						buttons[i].mod|modifiers[j],
-						c->win, 0, BUTTONMASK,
-						GrabModeAsync, GrabModeSync, None, None);
+	nbuttongrabs = 0;
+	for (i = 0; i < LENGTH(buttons); i++) {
+		if (buttons[i].click != ClickClientWin
+		 && buttons[i].click != ClickWinArea)
+			continue;
+		for (j = 0; j < LENGTH(modifiers); j++) {
+			mod = buttons[i].mod|modifiers[j];
+			for (k = 0; k < nbuttongrabs; k++)
+				if (buttongrabs[k].button == buttons[i].button
+				 && buttongrabs[k].mod == mod)
+					break;
+			if (k < nbuttongrabs)
+				continue;
+			buttongrabs[nbuttongrabs].button = buttons[i].button;
+			buttongrabs[nbuttongrabs++].mod = mod;
+		}
 	}
 }
 
 void
 attach(Client *c)
 {
-	c->next = c->mon->clients;
-	c->mon->clients = c;
+	attachafter(c, NULL);
+}
+
+/* insert c after the given client, or at the head if after is NULL */
+void
+attachafter(Client *c, Client *after)
+{
+	Monitor *m = c->mon;
+
+	counttags(c, 1);
+	c->prev = after;
+	c->next = after ? after->next : m->clients;
+	if (c->next)
+		c->next->prev = c;
+	else
+		m->clientstail = c;
+	if (after)
+		after->next = c;
+	else
+		m->clients = c;
 }
 
 void
 attachabove(Client *c)
 {
 	if (c->mon->sel == NULL
-	 || c->mon->sel == c->mon->clients
 	 || c->mon->sel->isfloating)
 	{
 		attach(c);
 		return;
 	}
 
-	Client *t;
-	for (t = c->mon->clients; t->next != c->mon->sel; t = t->next);
-	c->next = t->next;
-	t->next = c;
+	attachafter(c, c->mon->sel->prev);
 }
 
 void
@@ -3722,67 +4867,125 @@ attachbelow(Client *c)
 		return;
 	}
 
-	c->next = c->mon->sel->next;
-	c->mon->sel->next = c;
+	attachafter(c, c->mon->sel);
 }
 
 void
 attachtop(Client *c)
 {
-	Client **p;
-	Client *n;
+	Client *t, *after = NULL;
 
-	for (p = &c->mon->clients; *p && ismasterontag(*p); p = &(*p)->next);
-	n = nexttiled(*p);
-	*p = c;
-	c->next = n;
+	for (t = c->mon->clients; t && ismasterontag(t); t = t->next)
+		after = t;
+	attachafter(c, after);
 }
 
 void
 attachbottom(Client *c)
 {
-	Client **t;
-
-	for (t = &c->mon->clients; *t; t = &(*t)->next);
-	*t = c;
-	c->next = NULL;
+	attachafter(c, c->mon->clientstail);
 }
 
 void
 attachstack(Client *c)
 {
-	c->snext = c->mon->stack;
-	c->mon->stack = c;
+	Monitor *m = c->mon;
+
+	c->sprev = NULL;
+	c->snext = m->stack;
+	if (m->stack)
+		m->stack->sprev = c;
+	else
+		m->stacktail = c;
+	m->stack = c;
 }
 
 void
 attachstackbottom(Client *c)
 {
-	Client *below;
-	for (below = c->mon->stack; below && below->snext; below = below->snext);
+	Monitor *m = c->mon;
+
 	c->snext = NULL;
-	if (below)
-		below->snext = c;
+	c->sprev = m->stacktail;
+	if (m->stacktail)
+		m->stacktail->snext = c;
 	else
-		c->mon->stack = c;
+		m->stack = c;
+	m->stacktail = c;
 }
 
 void
 detach(Client *c)
 {
-	Client **tc;
+	Monitor *m = c->mon;
 
-	for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next);
-	*tc = c->next;
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		m->clients = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		m->clientstail = c->prev;
+	c->next = c->prev = NULL;
+	c->tiledidx = -1;
+	counttags(c, -1);
+}
+
+/* add n to the per-tag counters of c's monitor for each of c's tags */
+void
+counttags(Client *c, int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(tags); i++)
+		if (c->tags & (1 << i)) {
+			c->mon->ntagclients[i] += n;
+			if (c->isurgent)
+				c->mon->ntagurgent[i] += n;
+		}
+
+	c->isattached = n > 0;
+	c->mon->tiledvalid = 0;
+	c->mon->occgen++;
+	if (c->isurgent)
+		c->mon->urggen++;
+}
+
+/* set c's urgency flag, keeping the per-tag urgent counters in sync */
+void
+setisurgent(Client *c, int urg)
+{
+	unsigned int i;
+
+	if (c->isurgent == !!urg)
+		return;
+
+	c->isurgent = !!urg;
+	if (!c->isattached)
+		return;
+
+	for (i = 0; i < LENGTH(tags); i++)
+		if (c->tags & (1 << i))
+			c->mon->ntagurgent[i] += urg ? 1 : -1;
+	c->mon->urggen++;
 }
 
 void
 detachstack(Client *c)
 {
-	Client **tc, *t;
+	Monitor *m = c->mon;
+	Client *t;
 
-	for (tc = &c->mon->stack; *tc && *tc != c; tc = &(*tc)->snext);
-	*tc = c->snext;
+	if (c->sprev)
+		c->sprev->snext = c->snext;
+	else
+		m->stack = c->snext;
+	if (c->snext)
+		c->snext->sprev = c->sprev;
+	else
+		m->stacktail = c->sprev;
+	c->snext = c->sprev = NULL;
 
 	if (c == c->mon->sel) {
 		for (t = c->mon->stack; t && !ISVISIBLE(t); t = t->snext);
@@ -3793,20 +4996,22 @@ detachstack(Client *c)
 void
 grabkeys(void)
 {
-	updatenumlockmask();
-
-	{
-		unsigned int i, j;
-		unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
-		KeyCode code;
+	unsigned int i, j;
+	unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
+	KeyCode code;
 
-		XUngrabKey(dpy, AnyKey, AnyModifier, root);
+	XUngrabKey(dpy, AnyKey, AnyModifier, root);
+	dispatchclear(&keydispatch);
 
-		for (i = 0; i < LENGTH(keys); i++)
-			if ((code = XKeysymToKeycode(dpy, keys[i].keysym)))
-				for (j = 0; j < LENGTH(modifiers); j++)
-					XGrabKey(dpy, code, keys[i].mod|modifiers[j], root,
-						1, GrabModeAsync, GrabModeAsync);
+	for (i = 0; i < LENGTH(keys); i++) {
+		if (!(code = XKeysymToKeycode(dpy, keys[i].keysym)))
+			continue;
+		for (j = 0; j < LENGTH(modifiers); j++)
+			XGrabKey(dpy, code, keys[i].mod|modifiers[j], root,
+				1, GrabModeAsync, GrabModeAsync);
+		/* keys only match through the unshifted keysym of their keycode */
+		if (keys[i].func && XkbKeycodeToKeysym(dpy, code, 0, 0) == keys[i].keysym)
+			dispatchadd(&keydispatch, code, CLEANMASK(keys[i].mod), i);
 	}
 }
 
@@ -3889,50 +5094,140 @@ getcardprop(Window w, Atom prop, long *ret)
 	return 1;
 }
 
-Atom
-getatomprop(Window w, Atom prop)
+int
+gettextprop(Window w, Atom atom, char *text, unsigned int size)
 {
-	int format;
-	unsigned long nitems, remaining;
-	long *value = NULL;
-	Atom type, atom = None;
+	XTextProperty prop;
+	int ret;
 
-	if (XGetWindowProperty(dpy, w, prop, 0L, sizeof atom, 0, XA_ATOM,
-		&type, &format, &nitems, &remaining, (unsigned char **)&value) == Success
-		&& value)
-	{
-		atom = (Atom)*value;
-		XFree(value);
-	}
+	text[0] = '\0';
+	if (!size || !XGetTextProperty(dpy, w, &prop, atom))
+		return 0;
 
-	return atom;
+	ret = textproptotext(&prop, text, size);
+	XFree(prop.value);
+	return ret;
 }
 
+/* convert a text property to a string in the current locale */
 int
-gettextprop(Window w, Atom atom, char *text, unsigned int size)
+textproptotext(XTextProperty *prop, char *text, unsigned int size)
 {
-	XTextProperty prop;
 	char **list = NULL;
 	int n;
 
 	text[0] = '\0';
-	if (!size || !XGetTextProperty(dpy, w, &prop, atom) || !prop.nitems)
+	if (!size || !prop->nitems)
 		return 0;
 
-	if (prop.encoding == XA_STRING) {
-		strscpy(text, (char *)prop.value, size);
+	if (prop->encoding == XA_STRING) {
+		strsscpy(text, (char *)prop->value, size, prop->nitems);
 	}
-	else if (XmbTextPropertyToTextList(dpy, &prop, &list, &n) >= Success
+	else if (XmbTextPropertyToTextList(dpy, prop, &list, &n) >= Success
 		&& n > 0 && *list)
 	{
 		strscpy(text, *list, size);
 		XFreeStringList(list);
 	}
 	text[size - 1] = '\0';
-	XFree(prop.value);
 	return 1;
 }
 
+/* same as gettextprop(), for a GetProperty reply, which may be NULL */
+int
+proptotext(xcb_get_property_reply_t *r, char *text, unsigned int size)
+{
+	XTextProperty prop;
+
+	text[0] = '\0';
+	if (!r)
+		return 0;
+
+	prop.value = xcb_get_property_value(r);
+	prop.encoding = r->type;
+	prop.format = r->format;
+	prop.nitems = r->value_len;
+	return textproptotext(&prop, text, size);
+}
+
+/* send a GetProperty request for len 32-bit units of prop on w */
+xcb_get_property_cookie_t
+requestprop(Window w, Atom prop, Atom type, uint32_t len)
+{
+	return xcb_get_property(xcon, 0, w, prop, type, 0, len);
+}
+
+/* wait for a GetProperty reply; NULL if the property or the window is gone */
+xcb_get_property_reply_t *
+replyprop(xcb_get_property_cookie_t cookie)
+{
+	xcb_get_property_reply_t *r;
+
+	if ((r = xcb_get_property_reply(xcon, cookie, NULL)) && r->type == XCB_NONE) {
+		free(r);
+		r = NULL;
+	}
+	return r;
+}
+
+/* get the first value of a format 32 property reply, which may be NULL */
+int
+getpropvalue(xcb_get_property_reply_t *r, uint32_t *ret)
+{
+	if (!r || r->format != 32 || r->value_len < 1)
+		return 0;
+	*ret = *(uint32_t *)xcb_get_property_value(r);
+	return 1;
+}
+
+/* send the requests for all of w's properties that manage() needs, then
+ * collect the replies, so that they cost a single round trip.
+ * w's pid is looked up as well, unless it is already known (pid >= 0). */
+void
+getwinprops(Window w, int pid, WinProps *props)
+{
+	xcb_get_property_cookie_t cookies[PropLast];
+#ifdef __linux__
+	xcb_res_query_client_ids_cookie_t pidcookie;
+
+	if (pid < 0)
+		pidcookie = requestwinpids(&w, 1);
+#endif /* __linux__ */
+	int i;
+
+	cookies[PropClass] = requestprop(w, XA_WM_CLASS, XA_STRING, ClassPropSize);
+	cookies[PropNetWMName] = requestprop(w, netatoms[NetWMName], XCB_GET_PROPERTY_TYPE_ANY, WinTitleSize / 4);
+	cookies[PropWMName] = requestprop(w, XA_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, WinTitleSize / 4);
+	cookies[PropTransientFor] = requestprop(w, XA_WM_TRANSIENT_FOR, XA_WINDOW, 1);
+	cookies[PropNormalHints] = requestprop(w, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18);
+	cookies[PropNetWMState] = requestprop(w, netatoms[NetWMState], XA_ATOM, 1);
+	cookies[PropNetWMWindowType] = requestprop(w, netatoms[NetWMWindowType], XA_ATOM, 1);
+	cookies[PropWMHints] = requestprop(w, XA_WM_HINTS, XA_WM_HINTS, 9);
+	cookies[PropNetWMDesktop] = requestprop(w, netatoms[NetWMDesktop], XA_CARDINAL, 1);
+	cookies[PropWMProtocols] = requestprop(w, atoms[WMProtocols], XA_ATOM, ProtocolsPropSize);
+
+	for (i = 0; i < PropLast; i++)
+		props->replies[i] = replyprop(cookies[i]);
+
+	if (pid >= 0)
+		props->pid = pid;
+	else
+#ifdef __linux__
+		replywinpids(pidcookie, &w, &props->pid, 1);
+#else
+		props->pid = getwinpid(w);
+#endif /* __linux__ */
+}
+
+void
+freewinprops(WinProps *props)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++)
+		free(props->replies[i]);
+}
+
 int
 getxembedinfoprop(Window w, unsigned int *version, unsigned int *flags)
 {
@@ -3956,26 +5251,6 @@ getxembedinfoprop(Window w, unsigned int *version, unsigned int *flags)
 	return success;
 }
 
-long
-getstate(Window w)
-{
-	int format;
-	long *prop = NULL, result = -1;
-	unsigned long nitems, remaining;
-	Atom type;
-
-	if (XGetWindowProperty(dpy, w, atoms[WMState], 0, 2, 0, atoms[WMState],
-		&type, &format, &nitems, &remaining, (unsigned char **)&prop) == Success
-		&& prop
-		&& nitems)
-	{
-		result = prop[0];
-	}
-
-	XFree(prop);
-	return result;
-}
-
 int
 gettransientfor(Window w, Client **transfor)
 {
@@ -4013,14 +5288,10 @@ int
 sendevent(Client *c, Atom proto)
 {
 	XEvent ev;
-	Atom *protocols;
-	int nproto, exists = 0;
+	int exists;
 
-	if (XGetWMProtocols(dpy, c->win, &protocols, &nproto)) {
-		while (!exists && nproto--)
-			exists = (protocols[nproto] == proto);
-		XFree(protocols);
-	}
+	exists = (proto == atoms[WMDelete] && c->info->protocols & ProtoDelete)
+		|| (proto == atoms[WMTakeFocus] && c->info->protocols & ProtoTakeFocus);
 
 	if (exists) {
 		ev.type = ClientMessage;
@@ -4062,23 +5333,19 @@ sendxembedevent(Window w, long message, long detail, long data1, long data2)
 void
 seturgent(Client *c, int urg)
 {
-	XWMHints *wmh;
-
-	c->isurgent = urg;
-	if (!(wmh = XGetWMHints(dpy, c->win)))
+	setisurgent(c, urg);
+	if (!c->info->haswmhints)
 		return;
-	wmh->flags = urg ? (wmh->flags|XUrgencyHint) : (wmh->flags & ~XUrgencyHint);
-	XSetWMHints(dpy, c->win, wmh);
-	XFree(wmh);
+	c->info->wmhints.flags = urg ? (c->info->wmhints.flags|XUrgencyHint) : (c->info->wmhints.flags & ~XUrgencyHint);
+	XSetWMHints(dpy, c->win, &c->info->wmhints);
 }
 
 void
 tile(Monitor *m)
 {
-	unsigned int i, n, h, mw, my, ty;
+	unsigned int i, n = m->ntiled, h, mw, my, ty;
 	Client *c;
 
-	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
 	if (n == 0)
 		return;
 
@@ -4086,7 +5353,8 @@ tile(Monitor *m)
 		mw = m->nmaster ? m->ww * m->mfact : 0;
 	else
 		mw = m->ww - m->gappx;
-	for (i = 0, my = ty = m->gappx, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++)
+	for (i = 0, my = ty = m->gappx; i < n; i++) {
+		c = m->tiled[i];
 		if (i < m->nmaster) {
 			h = (m->wh - my) / (MIN(n, m->nmaster) - i) - m->gappx;
 			resize(c, m->wx + m->gappx, m->wy + my, mw - (2*c->bw) - m->gappx, h - (2*c->bw), 0);
@@ -4098,29 +5366,28 @@ tile(Monitor *m)
 			if (ty + HEIGHT(c) + m->gappx < m->wh)
 				ty += HEIGHT(c) + m->gappx;
 		}
+	}
 }
 
 void
 monocle(Monitor *m)
 {
-	unsigned int n = 0;
+	unsigned int i;
 	Client *c;
 
-	for (c = m->clients; c; c = c->next)
-		if (ISVISIBLE(c))
-			n++;
-	for (c = nexttiled(m->clients); c; c = nexttiled(c->next))
+	for (i = 0; i < m->ntiled; i++) {
+		c = m->tiled[i];
 		resize(c, m->wx, m->wy, m->ww - 2 * c->bw, m->wh - 2 * c->bw, 0);
+	}
 }
 
 void
 stairs(Monitor *m)
 {
-	int i, n, h, mw, my;
+	int i, n = m->ntiled, h, mw, my;
 	int ox, oy, ow, oh; /* offset values for stairs */
 	Client *c;
 
-	for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
 	if (n == 0)
 		return;
 
@@ -4128,7 +5395,8 @@ stairs(Monitor *m)
 		mw = m->nmaster ? m->ww * m->mfact : 0;
 	else
 		mw = m->ww - m->gappx;
-	for (i = 0, my = m->gappx, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++) {
+	for (i = 0, my = m->gappx; i < n; i++) {
+		c = m->tiled[i];
 		if (i < m->nmaster) {
 			h = (m->wh - my) / (MIN(n, m->nmaster) - i) - m->gappx;
 			resize(c, m->wx + m->gappx, m->wy + my, mw - (2 * c->bw) - m->gappx, h - (2 * c->bw), 0);
@@ -4152,16 +5420,7 @@ stairs(Monitor *m)
 int
 afloat(Client *c)
 {
-	int isfloating;
-
-	if (c->isfloating)
-		 return 1;
-
-	pertagpush(c->mon, c->tags);
-	isfloating = !c->mon->lt[c->mon->sellt]->arrange;
-	pertagpop(c->mon);
-
-	return isfloating;
+	return c->isfloating || !pertaglayout(c->mon, c->tags)->arrange;
 }
 
 unsigned int
@@ -4176,6 +5435,12 @@ int
 numtiledontag(Client *c)
 {
 	int i = 0;
+
+	if (c->tags == c->mon->tagset[c->mon->seltags]) {
+		updatetiled(c->mon);
+		return c->mon->ntiled;
+	}
+
 	c = nexttiledcore(c->mon->clients, c->tags);
 	for (; c; c = nexttiledcore(c->next, c->tags), i++);
 	return i;
@@ -4185,16 +5450,18 @@ int
 ismasterontag(Client *c)
 {
 	Client *t;
-	int i, ret;
+	int i;
 
-	for (i = 0, t = nexttiledcore(c->mon->clients, c->tags);
-	     t && t != c;
-	     t = nexttiledcore(t->next, c->tags), i++);
+	/* on the viewed tags, the tiled vector has c's position */
+	if (c->tags == c->mon->tagset[c->mon->seltags]) {
+		updatetiled(c->mon);
+		i = c->tiledidx >= 0 ? c->tiledidx : c->mon->ntiled;
+	} else
+		for (i = 0, t = nexttiledcore(c->mon->clients, c->tags);
+		     t && t != c;
+		     t = nexttiledcore(t->next, c->tags), i++);
 
-	pertagpush(c->mon, c->tags);
-	ret = i < c->mon->nmaster;
-	pertagpop(c->mon);
-	return ret;
+	return i < pertagnmaster(c->mon, c->tags);
 }
 
 Client *
@@ -4237,21 +5504,16 @@ nexttiledcore(Client *c, unsigned int tags)
 Client *
 prevtiled(Client *c)
 {
-	Client *p = c->mon->clients, *r = NULL;
-	for (; p && p != c; p = p->next)
-		if (!p->isfloating && ISVISIBLE(p))
-			r = p;
-	return r;
+	for (c = c->prev; c && (c->isfloating || !ISVISIBLE(c)); c = c->prev);
+	return c;
 }
 
 Client *
 lasttiled(Monitor *m)
 {
-	Client *p = m->clients, *r = NULL;
-	for (; p; p = p->next)
-		if (!p->isfloating && ISVISIBLE(p))
-			r = p;
-	return r;
+	Client *c;
+	for (c = m->clientstail; c && (c->isfloating || !ISVISIBLE(c)); c = c->prev);
+	return c;
 }
 
 void
@@ -4319,10 +5581,10 @@ renderinit(void)
 	XFont *font, *prevfont = NULL;
 	int i, j;
 
-	pixmap = XCreatePixmap(dpy, root, sw, sh, depth);
+	/* each monitor has its own pixmap to draw on, see rendersettarget() */
 	gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, gc, 1, LineSolid, CapButt, JoinMiter);
-	xftdraw = XftDrawCreate(dpy, pixmap, visual, colormap);
+	xftdraw = XftDrawCreate(dpy, root, visual, colormap);
 
 	/* init fonts */
 	for (i = 1; i <= LENGTH(fontdefs); i++)
@@ -4334,6 +5596,8 @@ renderinit(void)
 	if (!(fonts = prevfont))
 		die("no fonts could be loaded");
 
+	updatefontranges();
+
 	fontheight = fonts->height;
 	barheight = fontheight;
 	barheight *= barheightfact;
@@ -4358,10 +5622,19 @@ renderfree(void)
 {
 	int i, j;
 
-	XFreePixmap(dpy, pixmap);
 	XFreeGC(dpy, gc);
 	XftDrawDestroy(xftdraw);
+
+	/* free border pixmaps and gcs */
+	for (i = 0; i < LENGTH(borderpixmaps); i++)
+		if (borderpixmaps[i].pixmap)
+			XFreePixmap(dpy, borderpixmaps[i].pixmap);
+	for (i = 0; i < LENGTH(bordergcs); i++)
+		if (bordergcs[i].gc)
+			XFreeGC(dpy, bordergcs[i].gc);
+	stopfontworker();
 	renderfreefonts(fonts);
+	free(fontranges);
 
 	/* free colors */
 	for (i = 0; i < LENGTH(colors); i++)
@@ -4383,27 +5656,87 @@ renderfreefonts(XFont *font)
 	}
 }
 
+/* build the sorted list of font ranges that getcharfont() searches. */
 void
-renderupdatesize(void)
+updatefontranges(void)
 {
-	XFreePixmap(dpy, pixmap);
-	pixmap = XCreatePixmap(dpy, root, sw, barheight, depth);
+	unsigned long bounds[LENGTH(blockdefs) * 2], tmp;
+	int i, j, n, nbounds = 0;
+	FontRange *r;
+	XFont *font;
 
-	/* clear the pixmap */
-	/* XSetForeground(dpy, gc, schemes[SchemeNorm][ColorBG].pixel); */
-	/* XFillRectangle(dpy, pixmap, gc, 0, 0, sw, barheight); */
+	/* sort the boundaries of all blocks */
+	for (i = 0; i < LENGTH(blockdefs); i++) {
+		bounds[nbounds++] = blockdefs[i].start;
+		bounds[nbounds++] = blockdefs[i].end + 1;
+	}
+	for (i = 1; i < nbounds; i++)
+		for (j = i; j > 0 && bounds[j - 1] > bounds[j]; j--) {
+			tmp = bounds[j];
+			bounds[j] = bounds[j - 1];
+			bounds[j - 1] = tmp;
+		}
 
-	XftDrawDestroy(xftdraw);
-	xftdraw = XftDrawCreate(dpy, pixmap, visual, colormap);
+	free(fontranges);
+	fontranges = ecalloc(nbounds, sizeof(FontRange));
+	nfontranges = 0;
+
+	/* every range between two consecutive boundaries
+	 * is either fully inside a block or fully outside it */
+	for (i = 0; i + 1 < nbounds; i++) {
+		if (bounds[i] == bounds[i + 1])
+			continue;
+
+		r = &fontranges[nfontranges];
+		r->start = bounds[i];
+		r->end = bounds[i + 1] - 1;
+
+		for (n = 0, font = fonts; font && n < LENGTH(r->fonts); font = font->next) {
+			if (font->block == UnicodeGeneric)
+				continue;
+			for (j = 0; j < LENGTH(blockdefs); j++)
+				if (blockdefs[j].block == font->block
+				 && blockdefs[j].start <= r->start && r->end <= blockdefs[j].end)
+				{
+					r->fonts[n++] = font;
+					break;
+				}
+		}
+
+		if (n)
+			nfontranges++;
+	}
 }
 
 void
-rendermap(Monitor *m, int w, int dest_x)
+rendersettarget(Pixmap target)
 {
-	XCopyArea(dpy, pixmap, m->barwin, gc, 0, 0, w, barheight, dest_x, 0);
-	/* XSetForeground(dpy, gc, schemes[SchemeNorm][ColorBG].pixel); */
-	/* XFillRectangle(dpy, pixmap, gc, 0, 0, sw, barheight); */
-	/* XSync(dpy, 0); */
+	if (pixmap != target) {
+		pixmap = target;
+		XftDrawChange(xftdraw, pixmap);
+	}
+}
+
+/* restrict drawing to the area between x and x + w; w of 0 lifts it */
+void
+renderclip(int x, int w)
+{
+	XRectangle r = { x, 0, MAX(w, 0), barheight };
+
+	if (x || w) {
+		XSetClipRectangles(dpy, gc, 0, 0, &r, 1, Unsorted);
+		XftDrawSetClipRectangles(xftdraw, 0, 0, &r, 1);
+	} else {
+		XSetClipMask(dpy, gc, None);
+		XftDrawSetClip(xftdraw, None);
+	}
+}
+
+/* copy the area between x and x + w of the bar's pixmap to the bar */
+void
+rendermap(Monitor *m, int x, int w)
+{
+	XCopyArea(dpy, m->barpixmap, m->barwin, gc, x, 0, w, barheight, x, 0);
 }
 
 void
@@ -4477,7 +5810,7 @@ rendertext(int scheme, const char *string, int x, int y, int w, int h,
 		width += tmpwidth;
 	}
 
-	if (render)
+	if (render && w > 0)
 		XFillRectangle(dpy, pixmap, gc, x, y, w, h);
 
 	return x + pad;
@@ -4487,52 +5820,197 @@ void
 getfirstcharinfo(const char* string, XFont **font_ret, unsigned int *size_ret, int *width_ret)
 {
 	unsigned long codepoint;
-	int i;
+	CharInfo *glyph;
+	int cacheable;
 
 	utf8decodefirst(string, &codepoint, size_ret);
 
-	for (i = 0; i < utf8cache.len; i++)
-		if (codepoint == utf8cache.list[i].codepoint) {
-			*font_ret = utf8cache.list[i].font;
-			*width_ret = utf8cache.list[i].width;
-			return;
-		}
+	if ((glyph = glyphcacheget(codepoint))) {
+		glyphcache.hits++;
+		*font_ret = glyph->font;
+		*width_ret = glyph->width;
+		(*font_ret)->lastused = glyphcache.hits + glyphcache.misses;
+		return;
+	}
 
-	*font_ret = getcharfont(codepoint);
+	glyphcache.misses++;
+	*font_ret = getcharfont(codepoint, &cacheable);
 	*width_ret = (codepoint == UTF8ZWNBS)
 		? 0 : getcharwidth(*font_ret, string, *size_ret);
 
-	utf8cache.idx %= LENGTH(utf8cache.list);
-	utf8cache.list[utf8cache.idx].codepoint = codepoint;
-	utf8cache.list[utf8cache.idx].font = *font_ret;
-	utf8cache.list[utf8cache.idx].width = *width_ret;
-	utf8cache.len = MAX(utf8cache.len, utf8cache.idx++);
+	if (cacheable)
+		glyphcacheput(codepoint, *font_ret, *width_ret);
+	(*font_ret)->lastused = glyphcache.hits + glyphcache.misses;
 }
 
-XFont *
-getcharfont(unsigned long codepoint)
+CharInfo *
+glyphcacheget(unsigned long codepoint)
 {
-	XFont *font, *lastfont;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern, *match;
-	XftResult result;
+	GlyphCache *cache = &glyphcache;
 	int i;
 
-	for (font = fonts; font; font = font->next)
-		if (font->block != UnicodeGeneric)
-			for (i = 0; i < LENGTH(blockdefs); i++)
-				if (blockdefs[i].block == font->block
-				 && codepoint >= blockdefs[i].start
-				 && codepoint <= blockdefs[i].end
-				 && XftCharExists(dpy, font->xftfont, codepoint))
-				{
-					return font;
-				}
+	if (codepoint < GlyphDirectSize)
+		return cache->direct[codepoint].font ? &cache->direct[codepoint] : NULL;
+
+	for (i = cache->buckets[codepoint & (GlyphCacheSize - 1)]; i; i = cache->list[i].hnext)
+		if (cache->list[i].codepoint == codepoint)
+			break;
+
+	if (!i)
+		return NULL;
+
+	/* move to the front of the LRU list */
+	if (i != cache->head) {
+		cache->list[cache->list[i].prev].next = cache->list[i].next;
+		if (i == cache->tail)
+			cache->tail = cache->list[i].prev;
+		else
+			cache->list[cache->list[i].next].prev = cache->list[i].prev;
+		cache->list[i].prev = 0;
+		cache->list[i].next = cache->head;
+		cache->list[cache->head].prev = i;
+		cache->head = i;
+	}
+
+	return &cache->list[i].glyph;
+}
+
+void
+glyphcacheput(unsigned long codepoint, XFont *font, int width)
+{
+	GlyphCache *cache = &glyphcache;
+	int i, *b;
+
+	if (codepoint < GlyphDirectSize) {
+		cache->direct[codepoint].font = font;
+		cache->direct[codepoint].width = width;
+		return;
+	}
+
+	if (cache->len < GlyphCacheSize)
+		i = ++cache->len;
+	else {
+		/* evict the least recently used entry */
+		i = cache->tail;
+		cache->tail = cache->list[i].prev;
+		cache->list[cache->tail].next = 0;
+		for (b = &cache->buckets[cache->list[i].codepoint & (GlyphCacheSize - 1)];
+			*b != i; b = &cache->list[*b].hnext);
+		*b = cache->list[i].hnext;
+	}
+
+	cache->list[i].codepoint = codepoint;
+	cache->list[i].glyph.font = font;
+	cache->list[i].glyph.width = width;
+
+	b = &cache->buckets[codepoint & (GlyphCacheSize - 1)];
+	cache->list[i].hnext = *b;
+	*b = i;
+
+	cache->list[i].prev = 0;
+	cache->list[i].next = cache->head;
+	if (cache->head)
+		cache->list[cache->head].prev = i;
+	else
+		cache->tail = i;
+	cache->head = i;
+}
+
+void
+glyphcacheclear(void)
+{
+	memset(glyphcache.direct, 0, sizeof(glyphcache.direct));
+	memset(glyphcache.buckets, 0, sizeof(glyphcache.buckets));
+	glyphcache.head = glyphcache.tail = glyphcache.len = 0;
+}
+
+int
+nomatchfind(unsigned long codepoint)
+{
+	unsigned int i;
+
+	for (i = codepoint & (NoMatchSetSize - 1); nomatchset[i]; i = (i + 1) & (NoMatchSetSize - 1))
+		if (nomatchset[i] == codepoint)
+			return 1;
+
+	return 0;
+}
+
+void
+nomatchadd(unsigned long codepoint)
+{
+	unsigned int i;
+
+	/* start over rather than growing without bounds */
+	if (++nnomatch > NoMatchSetSize / 2) {
+		memset(nomatchset, 0, sizeof(nomatchset));
+		nnomatch = 1;
+	}
+
+	for (i = codepoint & (NoMatchSetSize - 1); nomatchset[i]; i = (i + 1) & (NoMatchSetSize - 1));
+	nomatchset[i] = codepoint;
+}
+
+/* cacheable is unset if the result must not go into the glyph cache */
+XFont *
+getcharfont(unsigned long codepoint, int *cacheable)
+{
+	XFont *font;
+	FontRange *r;
+	int i, lo, hi;
+
+	*cacheable = 1;
+
+	/* binary search the fonts that prefer the codepoint's block */
+	for (lo = 0, hi = nfontranges - 1; lo <= hi;) {
+		r = &fontranges[(lo + hi) / 2];
+		if (codepoint < r->start)
+			hi = (lo + hi) / 2 - 1;
+		else if (codepoint > r->end)
+			lo = (lo + hi) / 2 + 1;
+		else {
+			for (i = 0; i < LENGTH(r->fonts) && r->fonts[i]; i++)
+				if (XftCharExists(dpy, r->fonts[i]->xftfont, codepoint))
+					return r->fonts[i];
+			break;
+		}
+	}
 
 	for (font = fonts; font; font = font->next)
 		if (XftCharExists(dpy, font->xftfont, codepoint))
 			return font;
 
+	/* a dropped request is only retried if the codepoint isn't cached */
+	if (!nomatchfind(codepoint) && !requestfallbackfont(codepoint))
+		*cacheable = 0;
+
+	/* draw with the primary font until the fallback font is loaded */
+	return fonts;
+}
+
+/* queue a fontconfig match for codepoint on the font thread.
+ * readfontmatches() picks up the result. returns 0 if the queue is full
+ * and the request was dropped. */
+int
+requestfallbackfont(unsigned long codepoint)
+{
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FontMatch *fm;
+	int i;
+
+	for (i = 0; i < nfontpending; i++)
+		if (fontpending[i] == codepoint)
+			return 1;
+
+	if (nfontpending == LENGTH(fontpending)) {
+		fontdropped = 1;
+		return 0;
+	}
+
+	if (fontpipe[0] < 0)
+		startfontworker();
+
 	fccharset = FcCharSetCreate();
 	FcCharSetAddChar(fccharset, codepoint);
 
@@ -4546,31 +6024,197 @@ getcharfont(unsigned long codepoint)
 	if (!allowcolorfonts)
 		FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
 
+	/* do what XftFontMatch() does, except for the matching itself,
+	 * which is the slow part and doesn't need the display. */
 	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-	FcDefaultSubstitute(fcpattern);
-	match = XftFontMatch(dpy, screen, fcpattern, &result);
-
+	XftDefaultSubstitute(dpy, screen, fcpattern);
 	FcCharSetDestroy(fccharset);
-	FcPatternDestroy(fcpattern);
 
-	if (!match)
-		return fonts;
+	fm = ecalloc(1, sizeof(FontMatch));
+	fm->codepoint = codepoint;
+	fm->pattern = fcpattern;
+	fontpending[nfontpending++] = codepoint;
+
+	pthread_mutex_lock(&fontmutex);
+	fontqueue[fontqueuelen++] = fm;
+	pthread_cond_signal(&fontcond);
+	pthread_mutex_unlock(&fontmutex);
+
+	return 1;
+}
+
+void
+readfontmatches(int fd)
+{
+	FontMatch *fm;
+	Monitor *m;
+	int i, loaded = 0, oldpending = nfontpending;
+
+	while (read(fd, &fm, sizeof(fm)) == sizeof(fm)) {
+		for (i = 0; i < nfontpending && fontpending[i] != fm->codepoint; i++);
+		if (i < nfontpending)
+			fontpending[i] = fontpending[--nfontpending];
 
-	font = createfont(NULL, match);
-	if (font && XftCharExists(dpy, font->xftfont, codepoint)) {
-		/* TODO: add the character to the list of matched fonts */
-		for (lastfont = fonts; lastfont->next; lastfont = lastfont->next);
-		lastfont->next = font;
+		if (fm->match && addfallbackfont(fm->codepoint, fm->match))
+			loaded = 1;
+		else
+			nomatchadd(fm->codepoint);
+
+		FcPatternDestroy(fm->pattern);
+		free(fm);
 	}
-	else {
+
+	/* dropped requests are only made again when their codepoints are
+	 * looked up, so redraw once there is room for them in the queue */
+	if (fontdropped && nfontpending < oldpending)
+		fontdropped = 0;
+	else if (!loaded)
+		return;
+
+	/* the cache holds the primary font for the codepoints that
+	 * were pending, and the bars were drawn with it */
+	if (loaded)
+		glyphcacheclear();
+	for (m = mons; m; m = m->next) {
+		m->bs.isvalid = 0;
+		drawbar(m);
+	}
+}
+
+void
+startfontworker(void)
+{
+	if (pipe(fontpipe) == -1)
+		die("pipe:");
+	fcntl(fontpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fontpipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fontpipe[0], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&fontthread, NULL, fontworker, NULL))
+		die("cannot create the font thread");
+
+	addwatch(fontpipe[0], readfontmatches);
+}
+
+void
+stopfontworker(void)
+{
+	FontMatch *fm;
+
+	if (fontpipe[0] < 0)
+		return;
+
+	pthread_mutex_lock(&fontmutex);
+	fontquit = 1;
+	pthread_cond_signal(&fontcond);
+	pthread_mutex_unlock(&fontmutex);
+	pthread_join(fontthread, NULL);
+
+	while (fontqueuelen) {
+		fm = fontqueue[--fontqueuelen];
+		FcPatternDestroy(fm->pattern);
+		free(fm);
+	}
+	while (read(fontpipe[0], &fm, sizeof(fm)) == sizeof(fm)) {
+		if (fm->match)
+			FcPatternDestroy(fm->match);
+		FcPatternDestroy(fm->pattern);
+		free(fm);
+	}
+
+	delwatch(fontpipe[0]);
+	close(fontpipe[0]);
+	close(fontpipe[1]);
+	fontpipe[0] = fontpipe[1] = -1;
+}
+
+/* runs on its own thread, so it must only use fontconfig. */
+void *
+fontworker(void *unused)
+{
+	FontMatch *fm;
+	FcResult result;
+
+	while (1) {
+		pthread_mutex_lock(&fontmutex);
+		while (!fontqueuelen && !fontquit)
+			pthread_cond_wait(&fontcond, &fontmutex);
+		if (fontquit) {
+			pthread_mutex_unlock(&fontmutex);
+			return NULL;
+		}
+		fm = fontqueue[--fontqueuelen];
+		pthread_mutex_unlock(&fontmutex);
+
+		fm->match = FcFontMatch(NULL, fm->pattern, &result);
+		if (write(fontpipe[1], &fm, sizeof(fm)) != sizeof(fm))
+			die("cannot write to the font pipe:");
+	}
+}
+
+/* load the font that fontconfig matched for codepoint and append it to the
+ * fonts list. returns NULL if it lacks the codepoint. */
+XFont *
+addfallbackfont(unsigned long codepoint, FcPattern *match)
+{
+	XFont *font, *lastfont;
+	FcChar8 *file;
+	int index;
+
+	if (FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch
+		&& FcPatternGetInteger(match, FC_INDEX, 0, &index) == FcResultMatch)
+	{
+		for (font = fonts; font; font = font->next)
+			if (font->file && font->index == index
+			 && !strcmp((char *)font->file, (char *)file))
+			{
+				/* already loaded, maybe by a previous match */
+				FcPatternDestroy(match);
+				return XftCharExists(dpy, font->xftfont, codepoint) ? font : NULL;
+			}
+	}
+
+	if (!(font = createfont(NULL, match)))
+		return NULL;
+
+	if (!XftCharExists(dpy, font->xftfont, codepoint)) {
 		freefont(font);
-		font = fonts;
-		/* TODO: add the character to the list of nomatch fonts */
+		return NULL;
 	}
 
+	font->isfallback = 1;
+	for (lastfont = fonts; lastfont->next; lastfont = lastfont->next);
+	lastfont->next = font;
+	nfallbackfonts++;
+
 	return font;
 }
 
+/* free the least recently used fallback fonts above FallbackFontMax.
+ * rendertext() holds on to font pointers, so this must not be called
+ * while rendering. */
+void
+prunefallbackfonts(void)
+{
+	XFont **f, **lru, *font;
+
+	if (nfallbackfonts <= FallbackFontMax)
+		return;
+
+	while (nfallbackfonts > FallbackFontMax) {
+		for (lru = NULL, f = &fonts; *f; f = &(*f)->next)
+			if ((*f)->isfallback && (!lru || (*f)->lastused < (*lru)->lastused))
+				lru = f;
+		font = *lru;
+		*lru = font->next;
+		freefont(font);
+		nfallbackfonts--;
+	}
+
+	/* the cache may point to the freed fonts */
+	glyphcacheclear();
+}
+
 int
 getcharwidth(XFont *font, const char *string, unsigned int size)
 {
@@ -4629,6 +6273,11 @@ createfont(const char *fontname, FcPattern *fontpattern)
 	font->xftfont = xftfont;
 	font->pattern = pattern;
 	font->height = xftfont->ascent + xftfont->descent;
+	if (FcPatternGetString(xftfont->pattern, FC_FILE, 0, &font->file) != FcResultMatch
+		|| FcPatternGetInteger(xftfont->pattern, FC_INDEX, 0, &font->index) != FcResultMatch)
+	{
+		font->file = NULL;
+	}
 
 	return font;
 }
@@ -4755,8 +6404,6 @@ die(const char *fmt, ...)
 	exit(1);
 }
 
-/* TODO: don't constantly create/free pixmaps when drawing borders for windows and
- *       see if that speeds up their resizing (you just create one pixmap per depth) */
 /* TODO: make sure borderpx, gappx, stairpx etc. won't cause any negative width or height values
          also make sure and prove widths and heights are always positive */
 /* TODO: any new clients opening should un-fullscreen the currently fullscreened
@@ -4771,7 +6418,6 @@ die(const char *fmt, ...)
 /* TODO: either fix the backtrace or get rid of it */
 /* TODO: rewrite drwtext in a non-stupid way, then add farsi font support to it,
  *       (maybe then do the same thing to dmenu to draw icons with a mono nerd font?) */
-/* TODO: see if we can move to a circular doubly-linked list */
 /* TODO: maybe let's not define all the fucking variables of a function at the top, shall we? */
 /* TODO: analyze and simplify switchcol and push */
 /* TODO: analyze in what functions should restack(), focus(), arrange(), etc. be called  */
@@ -4784,7 +6430,7 @@ die(const char *fmt, ...)
  *       impolite and has opened up out of nowhere.
  *       also, blockinput can be done with time. duh. */
 /* TODO: make resettag work with floating and fullscreen clients too */
-/* TODO: do sth like damage tracking for drawbar(), arrange(), restack(), focus(), etc.
+/* TODO: do sth like damage tracking for arrange(), restack(), focus(), etc.
  * TODO: at the end of manage(), handle attaching a noautofocus client and stuff
  *       ideally, we want new functions or new code to attach not at the top of the stack;
  *       also we need to see wether we should set `c->mon->sel = c` or not. */
@@ -4793,9 +6439,7 @@ die(const char *fmt, ...)
 /* TODO: fix swallowing windows getting unmapped not restoring the terminal */
 /* TODO: merge https://github.com/cdown/dwm/commit/62cd7e9 after a while once it's stable */
 /* TODO: fix Arg functions on when they should exit early (floating, layout, etc.) */
-/* TODO: can come up with a solution to call updatebar only at the end of the event loop */
-/* TODO: probably can come up with a solution to call focus/arrange/restack only at the end of the event loop */
-/* TODO: track where updatebar/updatebars is called */
+/* TODO: probably can come up with a solution to call focus only at the end of the event loop */
 /* TODO: dick-hardening and possibly completely useless and ridiculous feature:
  *       highlight bar buttons on mouse-over */
 
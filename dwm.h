@@ -8,18 +8,40 @@ typedef struct StatusClick StatusClick;
 typedef struct Pertag Pertag;
 typedef struct BarState BarState;
 typedef struct ButtonPos ButtonPos;
+typedef struct ButtonGrab ButtonGrab;
 typedef struct Monitor Monitor;
 typedef struct Client Client;
+typedef struct ClientInfo ClientInfo;
 typedef struct Systray Systray;
 typedef struct ClickEv ClickEv;
+typedef struct WinMap WinMap;
+typedef struct Dispatch Dispatch;
+typedef struct BorderPixmap BorderPixmap;
+typedef struct BorderGC BorderGC;
+typedef struct WinProps WinProps;
+typedef struct Timer Timer;
+typedef struct Watch Watch;
 typedef struct XFont XFont;
-typedef struct UTF8Cache UTF8Cache;
+typedef struct FontRange FontRange;
+typedef struct FontMatch FontMatch;
+typedef struct CharInfo CharInfo;
+typedef struct GlyphCache GlyphCache;
 typedef struct UnicodeBlockDef UnicodeBlockDef;
 
 static void checkotherwm(void);
 static void setup(void);
 static void scan(void);
+static void setwinattrs(XWindowAttributes *wa, xcb_get_window_attributes_reply_t *attr, xcb_get_geometry_reply_t *geom);
 static void run(void);
+static void flushmons(void);
+static int addwatch(int fd, void (*func)(int fd));
+static void delwatch(int fd);
+static int addtimer(unsigned int ms, void (*func)(const Arg *arg), const Arg *arg) __attribute__((unused));
+static void deltimer(int id) __attribute__((unused));
+static void updatetimerfd(void);
+static void readtimers(int fd);
+static void readsignals(int fd);
+static void reapchildren(void);
 static void maprequest(XEvent *e);
 static void destroynotify(XEvent *e);
 static void unmapnotify(XEvent *e);
@@ -35,7 +57,10 @@ static void expose(XEvent *e);
 static void focusin(XEvent *e);
 static void resizerequest(XEvent *e);
 static void mappingnotify(XEvent *e);
-static void manage(Window w, XWindowAttributes wa);
+static void xkbevent(XEvent *e);
+static Client *createclient(void);
+static void freeclient(Client *c);
+static void manage(Window w, XWindowAttributes wa, int pid);
 static void unmanage(Client *c, int destroyed);
 static void cleanup(void);
 static void cleanupmon(Monitor *mon);
@@ -43,6 +68,7 @@ static int swallow(Client *c);
 static void unswallow(Client *c, int destroyed, int reattach);
 static void unmanageswallowed(Client *c);
 static void ignoreenter(Window w);
+static void checkignoreenter(Window w);
 static int isenterignored(Window w);
 static void tagreduced(Client *c, int unmanage, unsigned int newtags);
 static int updatemons(void);
@@ -54,37 +80,53 @@ static void updatestatusmonptr(void);
 static Monitor *createmon(void);
 static void applyrules(Client *c);
 static void focus(Client *c);
+static void setxkbgroup(unsigned int group);
 static void focusmon(Monitor *m);
 static void focusinput(Client *c);
 static void arrange(Monitor *m);
+static void arrangemon(Monitor *m);
+static void updatetiled(Monitor *m);
 static void showhide(Client *c);
 static void restack(Monitor *m);
-static void resize(Client *c, int x, int y, int w, int h, int interact);
-static void resizeclient(Client *c, int x, int y, int w, int h);
+static void restackmon(Monitor *m);
+static unsigned int stackappend(Window *wins, unsigned int n, Client *c);
+static int resize(Client *c, int x, int y, int w, int h, int interact);
+static int resizeclient(Client *c, int x, int y, int w, int h);
 static void sendconfigurenotify(Client *c);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
 static void updatesizehints(Client *c);
-static void loadclienttagsandmon(Client *c);
+static void setsizehints(Client *c, xcb_get_property_reply_t *r);
+static void loadclienttagsandmon(Client *c, xcb_get_property_reply_t *r);
 static void loadmonsettings(void);
-static void updateclass(Client *c);
+static void setclass(Client *c, xcb_get_property_reply_t *r);
 static void updatetitle(Client *c);
+static void settitle(Client *c, xcb_get_property_reply_t *netwmname, xcb_get_property_reply_t *wmname);
 static void updatewindowtype(Client *c);
+static void setwindowtype(Client *c, xcb_get_property_reply_t *state, xcb_get_property_reply_t *wtype);
 static void updatewmhints(Client *c);
+static void setwmhints(Client *c, xcb_get_property_reply_t *r);
+static void updateprotocols(Client *c);
+static void setprotocols(Client *c, xcb_get_property_reply_t *r);
 static void appendtoclientlist(Window w);
 static void updateclientlist(void);
 static void updateclientdesktop(Client *c);
+static void updatemondesktops(Monitor *m);
 static void updatecurrentdesktop(void);
 static void updatedesktops(void);
 static void updatewinbutton(Client *c);
 static void updatebarwin(Monitor *m);
 static void updatestatustext(void);
 static void drawbar(Monitor *m);
-static int barunchanged(Monitor *m);
+static void drawbarmon(Monitor *m);
+static unsigned int bardamage(Monitor *m);
 static void buttonpress(XEvent *e);
 static void handlestatusclick(Monitor *m, XButtonPressedEvent *ev);
 static int drawstatus(Monitor *m);
+static int parsestatus(Monitor *m, int x, int render);
 static int isseparator(char c);
-static void drawborder(Window w, int scm);
+static void drawborder(Client *c, int scm);
+static Pixmap getborderpixmap(int w, int h, int bw, int depth, int scm);
+static GC getbordergc(int depth, Drawable d);
 static void updateborder(Client *c);
 static void systrayupdate(void);
 static void systrayaddicon(Window w);
@@ -92,17 +134,32 @@ static void systrayupdateicon(Client *c, XResizeRequestEvent *resize);
 static void systrayremoveicon(Client *c);
 static int systrayinit(void);
 static void systraycleanup(void);
+#ifdef __linux__
+static xcb_res_query_client_ids_cookie_t requestwinpids(const Window *wins, int n);
+static void replywinpids(xcb_res_query_client_ids_cookie_t cookie, const Window *wins, unsigned int *pids, int n);
+#else
 static unsigned int getwinpid(Window w);
+#endif /* __linux__ */
 static Client *getparentterminal(Client *c);
 static int isdescprocess(unsigned int parent, unsigned int child);
 static unsigned int getparentpid(unsigned int pid);
 static void pertagload(Monitor *m, unsigned int tags, unsigned int newtags);
 static void pertagpush(Monitor *m, unsigned int newtags);
 static void pertagpop(Monitor *m);
+static const Layout *pertaglayout(Monitor *m, unsigned int tags);
+static int pertagnmaster(Monitor *m, unsigned int tags);
 static Client *wintoclient(Window w);
 static Client *origwintoclient(Window w);
 static Client *winbuttontoclient(Window w);
 static Client *wintosystrayicon(Window w);
+static unsigned int winmaphash(Window w);
+static Client *winmapget(Window w, int role);
+static void winmapset(Window w, Client *c, int role);
+static void winmapdel(Window w);
+static unsigned int dispatchhash(unsigned int code, unsigned int mod);
+static void dispatchclear(Dispatch *d);
+static void dispatchadd(Dispatch *d, unsigned int code, unsigned int mod, int index);
+static int dispatchfind(const Dispatch *d, unsigned int code, unsigned int mod, int *pos);
 static Monitor *wintomon(Window w);
 static Monitor *recttomon(int x, int y, int w, int h);
 static Monitor *dirtomon(int dir);
@@ -130,16 +187,15 @@ static void transfer(const Arg *arg);
 static void spawn(const Arg *arg);
 static void quit(const Arg *arg) __attribute__((unused));
 static void restart(const Arg *arg);
-static void sigrestart(int unused);
 #ifdef BACKTRACE
 static void sigbacktrace(int sig);
 #endif /* BACKTRACE */
-static void sigchld(int unused);
 static void movemouse(const Arg *arg);
 static void resizemouse(const Arg *arg);
 static void setfullscreen(Client *c, int fullscreen);
 static void grabbuttons(Client *c, int focused);
 static void attach(Client *c);
+static void attachafter(Client *c, Client *after);
 static void attachabove(Client *c) __attribute__((unused));
 static void attachbelow(Client *c) __attribute__((unused));
 static void attachtop(Client *c) __attribute__((unused));
@@ -147,19 +203,27 @@ static void attachbottom(Client *c) __attribute__((unused));
 static void attachstack(Client *c);
 static void attachstackbottom(Client *c);
 static void detach(Client *c);
+static void counttags(Client *c, int n);
+static void setisurgent(Client *c, int urg);
 static void detachstack(Client *c);
 static void grabkeys(void);
 static void updatenumlockmask(void);
+static void updatebuttongrabs(void);
 static void setcardprop(Window w, Atom prop, long value);
 static void setatomprop(Window w, Atom prop, Atom value);
 static void setwinprop(Window w, Atom prop, Window value);
 static void setfullscreenprop(Window w, int fullscreen);
 static void setwindowstate(Window w, long state);
 static int getcardprop(Window w, Atom prop, long *ret);
-static Atom getatomprop(Window w, Atom prop);
 static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
+static int textproptotext(XTextProperty *prop, char *text, unsigned int size);
+static int proptotext(xcb_get_property_reply_t *r, char *text, unsigned int size);
+static xcb_get_property_cookie_t requestprop(Window w, Atom prop, Atom type, uint32_t len);
+static xcb_get_property_reply_t *replyprop(xcb_get_property_cookie_t cookie);
+static int getpropvalue(xcb_get_property_reply_t *r, uint32_t *ret);
+static void getwinprops(Window w, int pid, WinProps *props);
+static void freewinprops(WinProps *props);
 static int getxembedinfoprop(Window w, unsigned int *version, unsigned int *flags);
-static long getstate(Window w);
 static int gettransientfor(Window w, Client **transfor);
 static int getrootptr(int *x, int *y);
 static int ismapped(Window w);
@@ -190,13 +254,27 @@ static Window createsimplewin(void);
 static void renderinit(void);
 static void renderfree(void);
 static void renderfreefonts(XFont *font);
-static void renderupdatesize(void);
-static void rendermap(Monitor *m, int w, int dest_x);
+static void updatefontranges(void);
+static void rendersettarget(Pixmap target);
+static void renderclip(int x, int w);
+static void rendermap(Monitor *m, int x, int w);
 static void renderrect(int scheme, int x, int y, int w, int h, int filled, int invert);
-static int rendergettextwidth(const char *string) __attribute__((unused));
+static int rendergettextwidth(const char *string);
 static int rendertext(int scheme, const char *string, int x, int y, int w, int h, int pad, int invert);
 static void getfirstcharinfo(const char *string, XFont **font, unsigned int *size, int *width);
-static XFont *getcharfont(unsigned long codepoint);
+static CharInfo *glyphcacheget(unsigned long codepoint);
+static void glyphcacheput(unsigned long codepoint, XFont *font, int width);
+static void glyphcacheclear(void);
+static int nomatchfind(unsigned long codepoint);
+static void nomatchadd(unsigned long codepoint);
+static XFont *getcharfont(unsigned long codepoint, int *cacheable);
+static int requestfallbackfont(unsigned long codepoint);
+static void readfontmatches(int fd);
+static void startfontworker(void);
+static void stopfontworker(void);
+static void *fontworker(void *unused);
+static XFont *addfallbackfont(unsigned long codepoint, FcPattern *match);
+static void prunefallbackfonts(void);
 static int getcharwidth(XFont *font, const char *string, unsigned int size);
 static XFont *createfont(const char *fontname, FcPattern *fontpattern);
 static void freefont(XFont *font);